@@ -27,7 +27,7 @@ if(NOT CMAKE_BUILD_EARLY_EXPANSION)
 endif()
 
 function(target_add_frogfs target path)
-    cmake_parse_arguments(ARG "" "NAME;CONFIG" "" ${ARGN})
+    cmake_parse_arguments(ARG "" "NAME;CONFIG;ALIGN" "" ${ARGN})
     if(NOT DEFINED ARG_NAME)
         get_filename_component(ARG_NAME ${path} NAME)
     endif()
@@ -35,6 +35,9 @@ function(target_add_frogfs target path)
         set(ARG_CONFIG ${CMAKE_CURRENT_SOURCE_DIR}/${ARG_CONFIG})
         set(config_json --config ${ARG_CONFIG})
     endif()
+    if(DEFINED ARG_ALIGN)
+        set(align --align ${ARG_ALIGN})
+    endif()
     set(output ${CMAKE_CURRENT_BINARY_DIR}/CMakeFiles/${target}.dir/${ARG_NAME})
 
     add_custom_target(frogfs_preprocess_${ARG_NAME}
@@ -49,7 +52,7 @@ function(target_add_frogfs target path)
     )
 
     add_custom_command(OUTPUT ${output}.bin
-        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/mkfrogfs.py ${output} ${output}.bin
+        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/mkfrogfs.py ${align} ${output} ${output}.bin
         DEPENDS frogfs_preprocess_${ARG_NAME} ${output}/.state ${output}/.config
         COMMENT "Creating frogfs binary ${ARG_NAME}.bin"
         VERBATIM
@@ -57,7 +60,7 @@ function(target_add_frogfs target path)
     )
 
     add_custom_command(OUTPUT ${output}_bin.c
-        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/bin2c.py ${output}.bin ${output}_bin.c
+        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/bin2c.py ${align} ${output}.bin ${output}_bin.c
         DEPENDS ${output}.bin
         COMMENT "Generating source file ${ARG_NAME}_bin.c"
         VERBATIM
@@ -66,7 +69,7 @@ function(target_add_frogfs target path)
 endfunction()
 
 function(declare_frogfs_bin path)
-    cmake_parse_arguments(ARG "" "NAME;CONFIG" "" ${ARGN})
+    cmake_parse_arguments(ARG "" "NAME;CONFIG;ALIGN;BASE" "" ${ARGN})
     if(NOT DEFINED ARG_NAME)
         get_filename_component(ARG_NAME ${path} NAME)
     endif()
@@ -74,6 +77,13 @@ function(declare_frogfs_bin path)
         set(ARG_CONFIG ${CMAKE_CURRENT_SOURCE_DIR}/${ARG_CONFIG})
         set(config_json --config ${ARG_CONFIG})
     endif()
+    if(DEFINED ARG_ALIGN)
+        set(align --align ${ARG_ALIGN})
+    endif()
+    if(DEFINED ARG_BASE)
+        set(ARG_BASE ${CMAKE_CURRENT_SOURCE_DIR}/${ARG_BASE})
+        set(base --base ${ARG_BASE})
+    endif()
     set(output ${CMAKE_CURRENT_BINARY_DIR}/CMakeFiles/${COMPONENT_LIB}.dir/frogfs_${ARG_NAME})
 
     add_custom_target(frogfs_preprocess_${ARG_NAME}
@@ -88,8 +98,8 @@ function(declare_frogfs_bin path)
     )
 
     add_custom_command(OUTPUT ${output}.bin
-        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/mkfrogfs.py ${output} ${output}.bin
-        DEPENDS frogfs_preprocess_${ARG_NAME} ${output}/.state ${output}/.config
+        COMMAND ${Python3_VENV} ${frogfs_DIR}/tools/mkfrogfs.py ${align} ${base} ${output} ${output}.bin
+        DEPENDS frogfs_preprocess_${ARG_NAME} ${output}/.state ${output}/.config ${ARG_BASE}
         COMMENT "Creating frogfs binary ${ARG_NAME}.bin"
         VERBATIM
         USES_TERMINAL
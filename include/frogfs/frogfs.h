@@ -14,9 +14,16 @@ extern "C" {
 #include <sys/types.h>
 
 typedef struct frogfs_fs_t frogfs_fs_t;
+typedef struct frogfs_obj_t frogfs_obj_t;
 typedef struct frogfs_file_t frogfs_file_t;
 typedef struct frogfs_config_t frogfs_config_t;
 typedef struct frogfs_stat_t frogfs_stat_t;
+typedef struct frogfs_file_storage_t frogfs_file_storage_t;
+typedef struct frogfs_dir_t frogfs_dir_t;
+typedef struct frogfs_meta_t frogfs_meta_t;
+typedef struct frogfs_variant_t frogfs_variant_t;
+typedef struct frogfs_segment_t frogfs_segment_t;
+typedef struct frogfs_stats_t frogfs_stats_t;
 
 /**
  * \brief Object type
@@ -30,8 +37,9 @@ typedef enum frogfs_stat_type_t {
  * \brief Object flags
  */
 typedef enum frogfs_flags_t {
-    FROGFS_FLAG_GZIP  = (1 << 0),
-    FROGFS_FLAG_CACHE = (1 << 1),
+    FROGFS_FLAG_GZIP     = (1 << 0),
+    FROGFS_FLAG_CACHE    = (1 << 1),
+    FROGFS_FLAG_TEMPLATE = (1 << 2),
 } frogfs_flags_t;
 
 /**
@@ -39,9 +47,61 @@ typedef enum frogfs_flags_t {
  */
 typedef enum frogfs_compression_type_t {
     FROGFS_COMPRESSION_NONE,
-    FROGFS_COMPRESSION_HEATSHRINK
+    FROGFS_COMPRESSION_HEATSHRINK,
+    FROGFS_COMPRESSION_LZ4,
 } frogfs_compression_type_t;
 
+/**
+ * \brief Content encodings of precompressed variants
+ */
+typedef enum frogfs_encoding_t {
+    FROGFS_ENCODING_IDENTITY,
+    FROGFS_ENCODING_GZIP,
+    FROGFS_ENCODING_BROTLI,
+} frogfs_encoding_t;
+
+/**
+ * \brief Precompiled template segment types
+ */
+typedef enum frogfs_segment_type_t {
+    FROGFS_SEGMENT_LITERAL, /**< a run of file data sent as is */
+    FROGFS_SEGMENT_TOKEN, /**< a %token% to be replaced */
+} frogfs_segment_type_t;
+
+/**
+ * \brief Integrity verification modes
+ */
+typedef enum frogfs_verify_t {
+    FROGFS_VERIFY_NONE, /**< only verify with \a frogfs_verify_step */
+    FROGFS_VERIFY_IMAGE, /**< check the whole image's CRC32 at init */
+    FROGFS_VERIFY_OPEN, /**< check each file's CRC32 when it is first
+            opened, failing the open on a mismatch */
+} frogfs_verify_t;
+
+/**
+ * \brief Read callback for images on storage that can't be memory mapped
+ *
+ * \return \a true if \a len bytes at \a offset of the image were read into
+ *         \a buf
+ */
+typedef bool (*frogfs_read_t)(
+    void *ctx, /** [in] \a read_ctx from the configuration */
+    uint32_t offset, /** [in] offset in the image */
+    void *buf, /** [out] destination buffer */
+    size_t len /** [in] number of bytes to read */
+);
+
+/**
+ * \brief Sink callback for \a frogfs_fpipe
+ *
+ * \return \a true to continue, \a false to stop with an error
+ */
+typedef bool (*frogfs_sink_t)(
+    void *user, /** [in] \a user passed to \a frogfs_fpipe */
+    const void *buf, /** [in] next chunk of file data */
+    size_t len /** [in] length of the chunk */
+);
+
 /**
  * \brief Configuration for the \a frogfs_init function
  */
@@ -51,6 +111,27 @@ struct frogfs_config_t {
     const char *part_label; /**< name of a partition to use as an frogfs
             filesystem. \a addr should be \a NULL if used */
 #endif
+    frogfs_read_t read; /**< read callback for an image that can't be mapped,
+            used if \a addr is \a NULL. The index tables and objects are read
+            into memory, and file data through a page cache */
+    void *read_ctx; /**< context passed to \a read */
+    uint16_t cache_pages; /**< number of read cache pages, or 0 for 4 */
+    uint32_t cache_page_len; /**< length of each read cache page, a power of
+            two, or 0 for 4096 */
+    uint16_t num_decoders; /**< number of heatshrink decoders to preallocate
+            and share between open files, or 0 to allocate them per file */
+    uint32_t decoder_wait_ms; /**< time to wait for a free pool decoder
+            before a read fails; only used on ESP_PLATFORM, elsewhere reads
+            fail immediately */
+    frogfs_verify_t verify; /**< integrity verification mode */
+    uint32_t hot_cache_len; /**< byte budget for decompressed copies of
+            frequently opened compressed files, which are then read as if
+            uncompressed, allocated from PSRAM when available; or 0 to
+            disable the hot cache */
+    uint8_t hot_cache_opens; /**< number of opens after which a file is
+            cached, or 0 for 2 */
+    frogfs_fs_t *base; /**< filesystem to mount a delta image on top of,
+            which must outlive this one, or NULL for a full image */
 };
 
 /**
@@ -62,6 +143,100 @@ struct frogfs_stat_t {
     frogfs_flags_t flags; /**< file flags */
     frogfs_compression_type_t compression; /**< compression type */
     size_t size; /**< file size */
+    const frogfs_obj_t *obj; /**< object reference, valid until
+            \a frogfs_deinit; pass to \a frogfs_fopen_obj or
+            \a frogfs_opendir_obj to open the file or directory without
+            looking up its path again */
+};
+
+/**
+ * \brief Storage for an open file, used with \a frogfs_fopen_into
+ *
+ * This allows a file to be opened without heap allocation, for instance on
+ * the stack or as part of a larger structure. Its contents are private, and
+ * it is larger than an open file needs so that fields can be added without
+ * changing its size.
+ */
+struct frogfs_file_storage_t {
+    void *opaque[12]; /**< reserved */
+};
+
+/**
+ * \brief Precomputed HTTP header values filled by \a frogfs_get_meta
+ *
+ * The strings point into the filesystem image. Values that were not stored
+ * are \a NULL.
+ */
+struct frogfs_meta_t {
+    const char *mime_type; /**< Content-Type value */
+    const char *content_length; /**< Content-Length value */
+    const char *etag; /**< ETag value, including quotes */
+    const char *cache_control; /**< Cache-Control value */
+};
+
+/**
+ * \brief Precompressed variant filled by \a frogfs_get_variant
+ */
+struct frogfs_variant_t {
+    frogfs_encoding_t encoding; /**< content encoding */
+    const void *data; /**< encoded data in the filesystem image, or NULL when
+                         it is not permanently mapped */
+    size_t len; /**< length of the encoded data */
+    uint32_t crc32; /**< CRC32 of the encoded data */
+};
+
+/**
+ * \brief Precompiled template segment filled by \a frogfs_get_segment
+ */
+struct frogfs_segment_t {
+    frogfs_segment_type_t type; /**< segment type */
+    uint32_t offset; /**< offset of a literal in the decompressed file */
+    size_t len; /**< length of a literal, or of the token name */
+    const char *token; /**< NUL terminated token name in the filesystem
+            image, without the % delimiters, or NULL for a literal */
+};
+
+/**
+ * \brief Runtime statistics filled by \a frogfs_get_stats
+ *
+ * Counters start at zero when the filesystem is initialized and wrap around
+ * on overflow.
+ */
+struct frogfs_stats_t {
+    uint32_t lookups; /**< path lookups */
+    uint32_t lookup_misses; /**< lookups of paths not in the image */
+    uint32_t collisions; /**< extra hash table candidates compared during
+            lookups, always zero with a minimal perfect hash */
+    uint32_t opens; /**< files opened */
+    uint32_t open_files; /**< files currently open */
+    uint32_t peak_open_files; /**< most files open at once */
+    uint32_t decoder_allocs; /**< heatshrink decoders allocated or taken
+            from the pool, and LZ4 block buffers allocated */
+    uint32_t decoder_failures; /**< decoder requests that failed because
+            the pool was empty or allocation failed */
+    uint32_t seek_resets; /**< decoder restarts caused by backward seeks */
+    uint32_t hot_hits; /**< opens served from the hot cache */
+    uint32_t hot_fills; /**< files decompressed into the hot cache */
+    uint64_t raw_bytes; /**< stored bytes consumed by \a frogfs_fread and
+            \a frogfs_fseek */
+    uint64_t decoded_bytes; /**< bytes produced by \a frogfs_fread and
+            \a frogfs_fseek, after decompression */
+};
+
+/**
+ * \brief Directory iterator filled by \a frogfs_opendir
+ *
+ * Its members should be treated as private; use \a frogfs_readdir,
+ * \a frogfs_telldir and \a frogfs_seekdir.
+ */
+struct frogfs_dir_t {
+    frogfs_fs_t *fs; /**< frogfs fs pointer */
+    uint16_t first; /**< index of the first child */
+    uint16_t count; /**< number of children */
+    uint16_t pos; /**< current position */
+    uint16_t base_first; /**< index of the first child in the base image,
+            for a delta image */
+    uint16_t base_count; /**< number of children in the base image */
 };
 
 /**
@@ -83,6 +258,9 @@ void frogfs_deinit(
 /**
  * \brief Get path for sorted frogfs object index
  *
+ * A delta image numbers the objects of its base image first, followed by
+ * its own, so paths it removes keep an index.
+ *
  * \return path or NULL if the index is invalid
  */
 const char *frogfs_get_path(
@@ -90,6 +268,48 @@ const char *frogfs_get_path(
     uint16_t index /** [in] frogfs file index */
 );
 
+/**
+ * \brief Get the alignment of file data in the filesystem image
+ *
+ * Memory returned by \a frogfs_faccess is aligned to this many bytes,
+ * provided the image itself is.
+ *
+ * \return alignment in bytes, 1 if the image was built without one
+ */
+size_t frogfs_get_align(
+    frogfs_fs_t *fs /** [in] frogfs fs pointer */
+);
+
+/**
+ * \brief Get a snapshot of the runtime statistics
+ *
+ * Statistics are only collected when built with CONFIG_FROGFS_STATS,
+ * otherwise \a stats is zeroed.
+ *
+ * \return \a true if statistics are collected
+ */
+bool frogfs_get_stats(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    frogfs_stats_t *stats /** [out] statistics */
+);
+
+/**
+ * \brief Verify files for up to a time budget
+ *
+ * Checks the CRC32 of the data and variants of files that have not been
+ * verified yet, picking up where the previous call stopped, so it can be
+ * called from a low priority task until it returns 0. Files that fail can
+ * no longer be opened. Images built without per-file checksums have nothing
+ * to verify.
+ *
+ * \return 1 if files remain, 0 when every file has been verified, or < 0 if
+ *         a file failed during this call
+ */
+int frogfs_verify_step(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    uint32_t budget_us /** [in] time budget in microseconds */
+);
+
 /**
  * \brief Get information about an frogfs object
  *
@@ -101,6 +321,103 @@ bool frogfs_stat(
     frogfs_stat_t *s /** [out] stat structure */
 );
 
+/**
+ * \brief Get the precomputed metadata of a file object
+ *
+ * \return \a true if the object has metadata
+ */
+bool frogfs_get_meta(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj, /** [in] frogfs object */
+    frogfs_meta_t *meta /** [out] metadata structure */
+);
+
+/**
+ * \brief Get a precompressed variant of a file object
+ *
+ * Variants are numbered from 0; iterate until this returns \a false.
+ *
+ * \return \a true if the variant exists
+ */
+bool frogfs_get_variant(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj, /** [in] frogfs object */
+    int index, /** [in] variant index */
+    frogfs_variant_t *variant /** [out] variant structure */
+);
+
+/**
+ * \brief Get a precompiled template segment of a file object
+ *
+ * Files with the FROGFS_FLAG_TEMPLATE flag carry the segments of their
+ * template, so that it can be rendered without scanning for delimiters.
+ * Segments are numbered from 0; iterate until this returns \a false.
+ *
+ * \return \a true if the segment exists
+ */
+bool frogfs_get_segment(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj, /** [in] frogfs object */
+    int index, /** [in] segment index */
+    frogfs_segment_t *segment /** [out] segment structure */
+);
+
+/**
+ * \brief Open a directory for iteration
+ *
+ * An empty path or "/" opens the root directory.
+ *
+ * \return \a true if a directory was found
+ */
+bool frogfs_opendir(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const char *path, /** [in] frogfs path */
+    frogfs_dir_t *dir /** [out] directory iterator */
+);
+
+/**
+ * \brief Open a directory for iteration by the object reference from
+ *        \a frogfs_stat or \a frogfs_readdir
+ *
+ * \return \a true if the object is a directory
+ */
+bool frogfs_opendir_obj(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj, /** [in] frogfs object */
+    frogfs_dir_t *dir /** [out] directory iterator */
+);
+
+/**
+ * \brief Read the next entry of an open directory
+ *
+ * On a delta image, the base directory's remaining entries come before those
+ * the delta adds.
+ *
+ * \return name of the entry without its parent path, or \a NULL at the end
+ *         of the directory
+ */
+const char *frogfs_readdir(
+    frogfs_dir_t *dir, /** [in] directory iterator */
+    frogfs_stat_t *s /** [out] stat structure, may be \a NULL */
+);
+
+/**
+ * \brief Get the current position of an open directory
+ *
+ * \return position to pass to \a frogfs_seekdir
+ */
+uint16_t frogfs_telldir(
+    frogfs_dir_t *dir /** [in] directory iterator */
+);
+
+/**
+ * \brief Set the current position of an open directory
+ */
+void frogfs_seekdir(
+    frogfs_dir_t *dir, /** [in] directory iterator */
+    uint16_t pos /** [in] position from \a frogfs_telldir */
+);
+
 /**
  * \brief Open a file from an \a frogfs_fs_t instance
  *
@@ -111,6 +428,46 @@ frogfs_file_t *frogfs_fopen(
     const char *path /** [in] frogfs path */
 );
 
+/**
+ * \brief Open a file from an \a frogfs_fs_t instance into caller provided
+ *        storage
+ *
+ * The storage must remain valid until the file is closed with
+ * \a frogfs_fclose.
+ *
+ * \return frogfs_file_t or \a NULL if not found
+ */
+frogfs_file_t *frogfs_fopen_into(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const char *path, /** [in] frogfs path */
+    frogfs_file_storage_t *storage /** [in] storage for the open file */
+);
+
+/**
+ * \brief Open a file by the object reference from \a frogfs_stat,
+ *        \a frogfs_readdir or \a frogfs_fstat
+ *
+ * \return frogfs_file_t or \a NULL if the object is not a file
+ */
+frogfs_file_t *frogfs_fopen_obj(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj /** [in] frogfs object */
+);
+
+/**
+ * \brief Open a file by object reference into caller provided storage
+ *
+ * The storage must remain valid until the file is closed with
+ * \a frogfs_fclose.
+ *
+ * \return frogfs_file_t or \a NULL if the object is not a file
+ */
+frogfs_file_t *frogfs_fopen_obj_into(
+    frogfs_fs_t *fs, /** [in] frogfs fs pointer */
+    const frogfs_obj_t *obj, /** [in] frogfs object */
+    frogfs_file_storage_t *storage /** [in] storage for the open file */
+);
+
 /**
  * \brief Close an open file object
  */
@@ -137,6 +494,28 @@ ssize_t frogfs_fread(
     size_t len /** [len] maximum bytes to read */
 );
 
+/**
+ * \brief Pass data from an open file object to a sink, chunk by chunk
+ *
+ * Starts at the current position. Uncompressed and LZ4 compressed data is
+ * handed to \a sink straight from the image or the decoded block, without
+ * copying. Heatshrink compressed data is decoded into \a buf, which may be
+ * the destination the sink sends from, such as a transmit buffer. The chunk
+ * is only valid for the duration of the callback.
+ *
+ * \return number of bytes passed to the sink, zero at end of file, or < 0
+ *         upon error or if the sink returned \a false
+ */
+ssize_t frogfs_fpipe(
+    frogfs_file_t *f, /** [in] frogfs file */
+    size_t len, /** [in] maximum bytes to pass, SIZE_MAX for the rest */
+    void *buf, /** [in] decode window for compressed data, may be \a NULL
+            for files that aren't heatshrink compressed */
+    size_t buf_len, /** [in] length of \a buf */
+    frogfs_sink_t sink, /** [in] sink callback */
+    void *user /** [in] argument passed to \a sink */
+);
+
 /**
  * \brief Seek to a position within an open file object
  *
@@ -160,6 +539,15 @@ size_t frogfs_ftell(
 /**
  * \brief Get raw memory for an uncompressed open file object
  *
+ * The memory is aligned to \a frogfs_get_align bytes, so it can be used
+ * directly for DMA when the image was built with a suitable alignment. With
+ * mmap windows enabled or an image mounted with a read callback, the memory
+ * is only valid until the next operation on the file or until it is closed,
+ * and with a read callback only files that fit in a cache page can be
+ * accessed. Compressed files opened while the hot cache holds a decompressed
+ * copy, see \a hot_cache_len, can be accessed too; the copy stays valid until
+ * the file is closed and is only aligned like any heap allocation.
+ *
  * \return length of file or < 0 upon error
  */
 ssize_t frogfs_faccess(
@@ -167,6 +555,20 @@ ssize_t frogfs_faccess(
     void **buf /** [out] doube pointer to buf */
 );
 
+/**
+ * \brief Get raw memory for a precompressed variant of an open file object
+ *
+ * Like \a frogfs_faccess, but for the variant at \a index, see
+ * \a frogfs_get_variant.
+ *
+ * \return length of variant or < 0 upon error
+ */
+ssize_t frogfs_faccess_variant(
+    frogfs_file_t *f, /** [in] frogfs file */
+    int index, /** [in] variant index */
+    void **buf /** [out] double pointer to buf */
+);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -11,17 +11,47 @@
  * \brief Magic number used in the frogfs file header
  */
 #define FROGFS_MAGIC 0x676F7246 /** Frog */
-#define FROGFS_VERSION_MAJOR 1
+#define FROGFS_VERSION_MAJOR 6
 #define FROGFS_VERSION_MINOR 0
 
 typedef struct frogfs_fs_header_t frogfs_fs_header_t;
-typedef struct frogfs_hashtable_entry_t frogfs_hashtable_entry_t;
+typedef struct frogfs_hash_prefix_entry_t frogfs_hash_prefix_entry_t;
+typedef struct frogfs_hash_entry_t frogfs_hash_entry_t;
+typedef struct frogfs_hash_ref_t frogfs_hash_ref_t;
 typedef struct frogfs_sorttable_entry_t frogfs_sorttable_entry_t;
+typedef struct frogfs_mph_slot_t frogfs_mph_slot_t;
+typedef struct frogfs_mph_bucket_t frogfs_mph_bucket_t;
+typedef struct frogfs_crc_entry_t frogfs_crc_entry_t;
 typedef struct frogfs_object_header_t frogfs_object_header_t;
+typedef struct frogfs_dir_header_t frogfs_dir_header_t;
 typedef struct frogfs_file_header_t frogfs_file_header_t;
+typedef struct frogfs_meta_header_t frogfs_meta_header_t;
+typedef struct frogfs_variant_entry_t frogfs_variant_entry_t;
+typedef struct frogfs_template_header_t frogfs_template_header_t;
+typedef struct frogfs_template_segment_t frogfs_template_segment_t;
 typedef struct frogfs_heatshrink_header_t frogfs_heatshrink_header_t;
+typedef struct frogfs_lz4_header_t frogfs_lz4_header_t;
+typedef struct frogfs_seektable_entry_t frogfs_seektable_entry_t;
 typedef struct frogfs_crc32_footer_t frogfs_crc32_footer_t;
 
+/**
+ * \brief File system header
+ *
+ * The header, index tables, dictionary and objects come first, followed by
+ * the file data from \a payload_offset onwards, so that the former can be
+ * mapped on their own. When \a dict_len is non-zero, a dictionary shared by
+ * heatshrink streams is located at \a dict_offset from the start of the
+ * image. File data starts at an offset that is a multiple of
+ * (1 << \a align_sz2). Fields past \a reserved are only present when \a len
+ * covers them.
+ *
+ * A non-zero \a base_crc32 marks a delta image, which holds the objects that
+ * differ from a base image and a tombstone for each path it removes, and is
+ * mounted on top of that base. It is the CRC32 of the base image's first
+ * \a payload_offset bytes. Readers of major version 4 and older would mount a
+ * delta image as a standalone tree, tombstones included, so delta images
+ * start at major version 5.
+ */
 struct frogfs_fs_header_t {
     uint32_t magic;
     uint8_t len;
@@ -29,18 +59,89 @@ struct frogfs_fs_header_t {
     uint16_t version_minor;
     uint32_t binary_len;
     uint16_t num_objects;
-    uint16_t reserved;
+    uint16_t num_mph_buckets;
+    uint16_t root_child_count;
+    uint16_t dict_len;
+    uint32_t dict_offset;
+    uint32_t payload_offset;
+    uint8_t align_sz2;
+    uint8_t hash_prefix_sz2;
+    uint8_t reserved[2];
+    uint32_t crc_offset;
+    uint32_t base_crc32;
 } __attribute__((packed));
 
-struct frogfs_hashtable_entry_t {
+/**
+ * \brief Hash index
+ *
+ * In images without a minimal perfect hash, the header is followed by a
+ * prefix table of (1 << \a hash_prefix_sz2) + 1 entries padded to a multiple
+ * of 4 bytes, then \a num_objects hash entries sorted by hash, then a
+ * reference entry for each of them in the same order. Paths are hashed with
+ * FNV-1a followed by the murmur3 finalizer. Images with a minimal perfect hash
+ * have no hash index, and the sort table directly follows the header.
+ *
+ * Prefix entry n is the index of the first hash whose top \a hash_prefix_sz2
+ * bits are n or more, so that a lookup only searches the few hashes sharing
+ * its prefix. A reference gives the object's offset and the length of its
+ * path, so that most candidates are rejected without reading their object.
+ * Major version 5 and older used a single table of hash and offset pairs,
+ * present with a minimal perfect hash too, so this layout starts at major
+ * version 6.
+ */
+struct frogfs_hash_prefix_entry_t {
+    uint16_t first;
+} __attribute__((packed));
+
+struct frogfs_hash_entry_t {
     uint32_t hash;
+} __attribute__((packed));
+
+struct frogfs_hash_ref_t {
     uint32_t offset;
+    uint16_t path_len;
+    uint16_t reserved;
 } __attribute__((packed));
 
 struct frogfs_sorttable_entry_t {
     uint32_t offset;
 } __attribute__((packed));
 
+/**
+ * \brief Minimal perfect hash tables
+ *
+ * When \a num_mph_buckets is non-zero, \a num_objects slot entries followed
+ * by \a num_mph_buckets bucket entries come after the sort table, padded to
+ * a multiple of 4 bytes. A path hashes to a bucket, and the bucket's seed
+ * selects the path's slot.
+ */
+struct frogfs_mph_slot_t {
+    uint32_t offset;
+} __attribute__((packed));
+
+struct frogfs_mph_bucket_t {
+    uint16_t seed;
+} __attribute__((packed));
+
+/**
+ * \brief File data checksum
+ *
+ * When \a crc_offset is non-zero, a table of \a num_objects entries, indexed
+ * like the sort table, holds the CRC32 of each file's stored data, or zero for
+ * directories.
+ */
+struct frogfs_crc_entry_t {
+    uint32_t crc32;
+} __attribute__((packed));
+
+/**
+ * \brief Object type of a tombstone
+ *
+ * In a delta image, an object header of this type followed by a path hides
+ * the base image's object at that path.
+ */
+#define FROGFS_TYPE_DELETED 2
+
 struct frogfs_object_header_t {
     uint8_t type;
     uint8_t len;
@@ -49,19 +150,132 @@ struct frogfs_object_header_t {
     uint16_t reserved;
 } __attribute__((packed));
 
+/**
+ * \brief Directory header
+ *
+ * Objects are numbered so that the children of each directory, and of the
+ * root directory, have consecutive sort table indexes. The root directory's
+ * children start at index 0.
+ */
+struct frogfs_dir_header_t {
+    frogfs_object_header_t object;
+    uint16_t child_index;
+    uint16_t child_count;
+} __attribute__((packed));
+
+/**
+ * \brief File header
+ *
+ * The file data is located at \a data_offset from the start of the image.
+ * Files with identical contents and compression share the same data.
+ */
 struct frogfs_file_header_t {
     frogfs_object_header_t object;
+    uint32_t data_offset;
     uint32_t data_len;
     uint32_t file_len;
     uint16_t flags;
     uint8_t compression;
+    uint8_t num_variants;
+} __attribute__((packed));
+
+/**
+ * \brief File metadata header
+ *
+ * Optional, present when the file's object length extends past the file
+ * header. It is followed by the MIME type, Content-Length, ETag and
+ * Cache-Control header values as NUL terminated strings, in that order.
+ * Each length includes the terminator, and a zero length means the value
+ * is absent.
+ */
+struct frogfs_meta_header_t {
+    uint8_t mime_type_len;
+    uint8_t content_length_len;
+    uint8_t etag_len;
+    uint8_t cache_control_len;
+} __attribute__((packed));
+
+/**
+ * \brief Precompressed variant entry
+ *
+ * When \a num_variants is non-zero, a table of variants follows the file's
+ * path. Each variant is the whole file in another content encoding, served as
+ * is to clients that accept it. Offsets are relative to the start of the
+ * image.
+ */
+struct frogfs_variant_entry_t {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t crc32;
+    uint8_t encoding;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+/**
+ * \brief Template header
+ *
+ * With the FROGFS_FLAG_TEMPLATE flag set, a precompiled template follows the
+ * variant table: this header, \a num_segments segments, then \a names_len
+ * bytes of NUL terminated token names, padded to a multiple of 4 bytes.
+ * Replaying the segments in order renders the template.
+ */
+struct frogfs_template_header_t {
+    uint16_t num_segments;
+    uint16_t names_len;
+} __attribute__((packed));
+
+/**
+ * \brief Template segment
+ *
+ * A literal segment covers \a len bytes of the decompressed file from
+ * \a offset. A token segment refers to a token name of \a len bytes at
+ * \a offset from the start of the names.
+ */
+struct frogfs_template_segment_t {
+    uint32_t offset;
+    uint16_t len;
+    uint8_t type;
     uint8_t reserved;
 } __attribute__((packed));
 
+/**
+ * \brief Heatshrink header
+ *
+ * With the FROGFS_HEATSHRINK_DICT flag set, each stream is decoded with a
+ * window that starts out holding the last (1 << \a window_sz2) bytes of the
+ * image's dictionary. Readers refuse streams with flags they don't know.
+ */
 struct frogfs_heatshrink_header_t {
     uint8_t window_sz2;
     uint8_t lookahead_sz2;
-    uint16_t reserved;
+    uint8_t block_sz2;
+    uint8_t flags;
+} __attribute__((packed));
+
+#define FROGFS_HEATSHRINK_DICT (1 << 0)
+
+/**
+ * \brief LZ4 header
+ *
+ * Followed by the seek table when \a block_sz2 is non-zero, then the LZ4
+ * block format data. With a \a block_sz2 of zero the whole file is a single
+ * block.
+ */
+struct frogfs_lz4_header_t {
+    uint8_t block_sz2;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+/**
+ * \brief Seek table entry, one per block of decompressed data
+ *
+ * When \a block_sz2 is non-zero, the compressed data is split into
+ * independent streams of (1 << block_sz2) decompressed bytes each. A table
+ * of offsets, relative to the end of the table, follows the compression
+ * header.
+ */
+struct frogfs_seektable_entry_t {
+    uint32_t offset;
 } __attribute__((packed));
 
 struct frogfs_crc32_footer_t {
@@ -22,6 +22,9 @@ cwhttpd_status_t frogfs_route_get(cwhttpd_conn_t *conn);
 
 /**
  * \brief Espfs template route handler
+ *
+ * Files with the FROGFS_FLAG_TEMPLATE flag are rendered from their
+ * precompiled segments, others are scanned for %token% delimiters.
  */
 cwhttpd_status_t frogfs_route_tpl(cwhttpd_conn_t *conn);
 
@@ -30,6 +33,14 @@ cwhttpd_status_t frogfs_route_tpl(cwhttpd_conn_t *conn);
  */
 cwhttpd_status_t frogfs_route_index(cwhttpd_conn_t *conn);
 
+/**
+ * \brief Espfs statistics route handler
+ *
+ * Responds with the output of \a frogfs_get_stats as a JSON object, or falls
+ * through when built without CONFIG_FROGFS_STATS.
+ */
+cwhttpd_status_t frogfs_route_stats(cwhttpd_conn_t *conn);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -20,9 +20,11 @@ typedef struct esp_vfs_frogfs_conf_t esp_vfs_frogfs_conf_t;
  */
 struct esp_vfs_frogfs_conf_t {
     const char *base_path; /**< vfs path to mount the filesystem */
-    const char *overlay_path; /**< vfs overlay search path */
+    const char *overlay_path; /**< vfs overlay search path. It is indexed
+            at registration, and later changes to files that are also in the
+            image must be made through the frogfs mount */
     frogfs_fs_t *fs; /**< the frogfs instance */
-    size_t max_files; /**< maximum open files */
+    size_t max_files; /**< maximum open files, shared by all tasks */
 };
 
 /**
@@ -3,9 +3,9 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 /**
- * This is a read-only filesystem that uses a sorted hash table to locate
- * objects in a monolithic binary. The binary is generated by the mkfrogfsimg
- * tool that comes with this source distribution.
+ * This is a read-only filesystem that uses a minimal perfect hash or a sorted
+ * hash table to locate objects in a monolithic binary. The binary is
+ * generated by the mkfrogfsimg tool that comes with this source distribution.
  */
 
 #include "frogfs_priv.h"
@@ -18,17 +18,1133 @@
 #endif
 
 #if defined(ESP_PLATFORM)
+# include <esp_heap_caps.h>
 # include <esp_partition.h>
+# include <esp_rom_crc.h>
+# include <esp_timer.h>
 # include <spi_flash_mmap.h>
+# include <freertos/FreeRTOS.h>
+# include <freertos/queue.h>
+#else
+# include <time.h>
+#endif
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+/* heatshrink has no API to reconfigure or prime a decoder, so decoder_get and
+ * heatshrink_prime set fields of heatshrink_decoder directly. They follow the
+ * heatshrink 0.4.1 layout, which is checked here so that updating the
+ * submodule fails to build until they have been checked against it. */
+# if HEATSHRINK_VERSION_MAJOR != 0 || HEATSHRINK_VERSION_MINOR != 4 || \
+        HEATSHRINK_VERSION_PATCH != 1
+#  error "check decoder_get and heatshrink_prime against this heatshrink"
+# endif
+_Static_assert(sizeof(((heatshrink_decoder *) 0)->window_sz2) == 1 &&
+        sizeof(((heatshrink_decoder *) 0)->lookahead_sz2) == 1,
+        "unexpected heatshrink_decoder layout");
+/* the input buffer is followed by the window in buffers[] */
+_Static_assert(sizeof(((heatshrink_decoder *) 0)->head_index) == 2 &&
+        offsetof(heatshrink_decoder, buffers) == sizeof(heatshrink_decoder),
+        "unexpected heatshrink_decoder layout");
+#endif
+
+#ifndef CONFIG_FROGFS_HEATSHRINK_INPUT_BUFFER
+# define CONFIG_FROGFS_HEATSHRINK_INPUT_BUFFER 128
+#endif
+
+#define SEEK_SKIP_LEN (256)
+#define HOT_CACHE_OPENS (2)
+#define VERIFY_CHUNK_LEN (4096)
+
+#if defined(CONFIG_FROGFS_STATS)
+# define STATS_ADD(fs, field, n) \
+        __atomic_fetch_add(&(fs)->stats.field, (n), __ATOMIC_RELAXED)
+#else
+# define STATS_ADD(fs, field, n) ((void) 0)
+#endif
+
+static void stats_open(frogfs_fs_t *fs)
+{
+#if defined(CONFIG_FROGFS_STATS)
+    uint32_t open_files = __atomic_add_fetch(&fs->stats.open_files, 1,
+            __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&fs->stats.peak_open_files,
+            __ATOMIC_RELAXED);
+    while (open_files > peak && !__atomic_compare_exchange_n(
+            &fs->stats.peak_open_files, &peak, open_files, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    STATS_ADD(fs, opens, 1);
+#endif
+}
+
+static void window_lock(frogfs_fs_t *fs)
+{
+#if defined(ESP_PLATFORM)
+    if (fs->window_lock != NULL) {
+        xSemaphoreTake(fs->window_lock, portMAX_DELAY);
+    }
+#endif
+}
+
+static void window_unlock(frogfs_fs_t *fs)
+{
+#if defined(ESP_PLATFORM)
+    if (fs->window_lock != NULL) {
+        xSemaphoreGive(fs->window_lock);
+    }
+#endif
+}
+
+static int windows_init(frogfs_fs_t *fs, int num_windows)
+{
+    fs->windows = calloc(num_windows, sizeof(frogfs_window_t));
+    if (fs->windows == NULL) {
+        LOGE(__func__, "calloc failed");
+        return -1;
+    }
+    fs->num_windows = num_windows;
+
+#if defined(ESP_PLATFORM)
+    fs->window_lock = xSemaphoreCreateMutex();
+    if (fs->window_lock == NULL) {
+        LOGE(__func__, "xSemaphoreCreateMutex failed");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void windows_deinit(frogfs_fs_t *fs)
+{
+    for (int i = 0; i < fs->num_windows; i++) {
+#if defined(ESP_PLATFORM)
+        if (fs->read == NULL && fs->windows[i].addr != NULL) {
+            spi_flash_munmap(fs->windows[i].handle);
+        }
+#endif
+        free(fs->windows[i].buf);
+    }
+    free(fs->windows);
+
+#if defined(ESP_PLATFORM)
+    if (fs->window_lock != NULL) {
+        vSemaphoreDelete(fs->window_lock);
+    }
 #endif
+}
+
+/* Read the page holding len bytes at offset into a window. Pages normally
+ * start at a multiple of the page length, and are grown for ranges that
+ * don't fit. */
+static bool page_fill(frogfs_fs_t *fs, frogfs_window_t *w, uint32_t offset,
+        uint32_t len)
+{
+    uint32_t align = frogfs_get_align(fs);
+    uint32_t start = offset & ~((fs->page_len - 1) | (align - 1));
+    if (offset + len > start + fs->page_len) {
+        start = offset & ~(align - 1);
+    }
+    uint32_t end = start + fs->page_len;
+    if (end < offset + len) {
+        end = offset + len;
+    }
+    if (end > fs->header->binary_len) {
+        end = fs->header->binary_len;
+    }
+
+    /* keep data aligned in memory as it is in the image */
+    if (end - start + align - 1 > w->buf_len) {
+        free(w->buf);
+        w->buf_len = 0;
+        w->buf = malloc(end - start + align - 1);
+        if (w->buf == NULL) {
+            LOGE(__func__, "malloc failed");
+            return false;
+        }
+        w->buf_len = end - start + align - 1;
+    }
+    uint8_t *addr = (uint8_t *) (((uintptr_t) w->buf + align - 1) &
+            ~(uintptr_t) (align - 1));
+
+    if (!fs->read(fs->read_ctx, start, addr, end - start)) {
+        LOGE(__func__, "read of %" PRIu32 " bytes at %08" PRIx32 " failed",
+                end - start, start);
+        return false;
+    }
+    LOGV(__func__, "page %d at %08" PRIx32 ", %" PRIu32 " bytes",
+            (int) (w - fs->windows), start, end - start);
+    w->addr = addr;
+    w->offset = start;
+    w->len = end - start;
+    return true;
+}
+
+#if defined(CONFIG_FROGFS_USE_MMAP_WINDOWS)
+/* Map the flash pages holding len bytes at offset into a window, mapping at
+ * least CONFIG_FROGFS_MMAP_WINDOW_SIZE bytes. */
+static bool mmap_fill(frogfs_fs_t *fs, frogfs_window_t *w, uint32_t offset,
+        uint32_t len)
+{
+    uint32_t start = offset & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    uint32_t end = offset + len;
+    if (end < start + CONFIG_FROGFS_MMAP_WINDOW_SIZE) {
+        end = start + CONFIG_FROGFS_MMAP_WINDOW_SIZE;
+    }
+    end = (end + SPI_FLASH_MMU_PAGE_SIZE - 1) & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    if (end > fs->partition->size) {
+        end = fs->partition->size;
+    }
+
+    const void *addr;
+    if (esp_partition_mmap(fs->partition, start, end - start,
+            SPI_FLASH_MMAP_DATA, &addr, &w->handle) != ESP_OK) {
+        LOGE(__func__, "mmap failed");
+        return false;
+    }
+    LOGV(__func__, "window %d at %08" PRIx32 ", %" PRIu32 " bytes",
+            (int) (w - fs->windows), start, end - start);
+    w->addr = addr;
+    w->offset = start;
+    w->len = end - start;
+    return true;
+}
+#endif
+
+static void window_put(frogfs_fs_t *fs, frogfs_window_t *w)
+{
+    window_lock(fs);
+    w->refs--;
+    window_unlock(fs);
+}
+
+/* Return a window holding len bytes at offset, filling the least recently
+ * used idle window if no window holds them yet. */
+static frogfs_window_t *window_get(frogfs_fs_t *fs, uint32_t offset,
+        uint32_t len)
+{
+    frogfs_window_t *w, *victim = NULL;
+
+    window_lock(fs);
+    for (int i = 0; i < fs->num_windows; i++) {
+        w = &fs->windows[i];
+        if (w->addr != NULL && offset >= w->offset &&
+                offset + len <= w->offset + w->len) {
+            goto found;
+        }
+        if (w->refs == 0 && (victim == NULL || w->addr == NULL ||
+                (victim->addr != NULL && w->last_use < victim->last_use))) {
+            victim = w;
+        }
+    }
+
+    if (victim == NULL) {
+        window_unlock(fs);
+        LOGE(__func__, "no idle window");
+        return NULL;
+    }
+
+    w = victim;
+    bool filled = false;
+    if (fs->read != NULL) {
+        w->addr = NULL;
+        filled = page_fill(fs, w, offset, len);
+    } else {
+#if defined(CONFIG_FROGFS_USE_MMAP_WINDOWS)
+        if (w->addr != NULL) {
+            spi_flash_munmap(w->handle);
+            w->addr = NULL;
+        }
+        filled = mmap_fill(fs, w, offset, len);
+#endif
+    }
+    if (!filled) {
+        window_unlock(fs);
+        return NULL;
+    }
+
+found:
+    w->refs++;
+    w->last_use = ++fs->window_clock;
+    window_unlock(fs);
+    return w;
+}
+
+/* Map len bytes of the image at offset for an open file, setting avail, if
+ * not NULL, to the number of bytes readable there. The memory stays valid
+ * until the next call for the same file, or until it is closed. */
+static const void *data_map(frogfs_file_t *f, uint32_t offset, uint32_t len,
+        uint32_t *avail)
+{
+    frogfs_fs_t *fs = f->fs;
+
+    if (offset > fs->header->binary_len ||
+            len > fs->header->binary_len - offset) {
+        LOGE(__func__, "%" PRIu32 " bytes at %08" PRIx32 " out of bounds",
+                len, offset);
+        return NULL;
+    }
+
+    if (offset + len <= fs->mapped_len) {
+        if (avail != NULL) {
+            *avail = fs->mapped_len - offset;
+        }
+        return (const void *) fs->header + offset;
+    }
+
+    if (fs->windows == NULL) {
+        return NULL;
+    }
+
+    frogfs_window_t *w = f->window;
+    if (w == NULL || offset < w->offset ||
+            offset + len > w->offset + w->len) {
+        if (w != NULL) {
+            window_put(fs, w);
+        }
+        w = f->window = window_get(fs, offset, len);
+        if (w == NULL) {
+            return NULL;
+        }
+    }
+    if (avail != NULL) {
+        *avail = w->offset + w->len - offset;
+    }
+    return w->addr + (offset - w->offset);
+}
+
+/* Release the window held by a file, if any */
+static void data_unmap(frogfs_file_t *f)
+{
+    if (f->window != NULL) {
+        window_put(f->fs, f->window);
+        f->window = NULL;
+    }
+}
+
+/* Return the path of the object at index in this image's own sort table */
+static const char *local_path(frogfs_fs_t *fs, uint16_t index)
+{
+    if (index >= fs->header->num_objects) {
+        return NULL;
+    }
+
+    const frogfs_sorttable_entry_t *entry = fs->sorttable + index;
+    const frogfs_object_header_t *object = (const void *) fs->header +
+            entry->offset;
+    return (const char *) object + object->len;
+}
+
+/* Continue a zlib compatible CRC32 */
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+#if defined(ESP_PLATFORM)
+    return esp_rom_crc32_le(crc, buf, len);
+#else
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0xF];
+        crc = (crc >> 4) ^ table[crc & 0xF];
+    }
+    return ~crc;
+#endif
+}
+
+static int64_t time_us(void)
+{
+#if defined(ESP_PLATFORM)
+    return esp_timer_get_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Continue a CRC32 of len bytes at offset from st->pos, stopping after a
+ * chunk once the deadline, if not 0, has passed. Returns 1 when done, 0 when
+ * out of time or < 0 on error. */
+static int verify_range(frogfs_file_t *f, uint32_t offset, uint32_t len,
+        frogfs_verify_state_t *st, int64_t deadline)
+{
+    while (st->pos < len) {
+        uint32_t avail;
+        const void *p = data_map(f, offset + st->pos, 1, &avail);
+        if (p == NULL) {
+            return -1;
+        }
+        if (avail > len - st->pos) {
+            avail = len - st->pos;
+        }
+        if (avail > VERIFY_CHUNK_LEN) {
+            avail = VERIFY_CHUNK_LEN;
+        }
+        st->crc = crc32_update(st->crc, p, avail);
+        st->pos += avail;
+        if (deadline != 0 && st->pos < len && time_us() >= deadline) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Verify the data and variants of the file at st->index, resuming from st.
+ * Returns 1 if the file passed, 0 when out of time, or < 0 if it failed.
+ * The result is recorded in the verified and corrupt bitmaps; concurrent
+ * updates may lose a bit, which only means verifying a file again. */
+static int verify_file(frogfs_fs_t *fs, frogfs_verify_state_t *st,
+        int64_t deadline)
+{
+    const frogfs_file_header_t *fh = (const void *) fs->header +
+            fs->sorttable[st->index].offset;
+    const frogfs_variant_entry_t *variants = (const void *) fh +
+            fh->object.len + fh->object.path_len;
+    frogfs_file_t f = { .fs = fs };
+    int ret = 1;
+
+    for (; st->region <= fh->num_variants; st->region++) {
+        uint32_t offset = fh->data_offset;
+        uint32_t len = fh->data_len;
+        uint32_t crc = fs->crcs[st->index].crc32;
+        if (st->region > 0) {
+            offset = variants[st->region - 1].offset;
+            len = variants[st->region - 1].len;
+            crc = variants[st->region - 1].crc32;
+        }
+
+        ret = verify_range(&f, offset, len, st, deadline);
+        if (ret == 0) {
+            goto out;
+        }
+        if (ret < 0 || st->crc != crc) {
+            LOGE(__func__, "%s: checksum mismatch",
+                    local_path(fs, st->index));
+            fs->corrupt[st->index / 32] |= 1u << (st->index % 32);
+            ret = -1;
+            goto out;
+        }
+        st->pos = 0;
+        st->crc = 0;
+    }
+    fs->verified[st->index / 32] |= 1u << (st->index % 32);
+
+out:
+    data_unmap(&f);
+    return ret;
+}
+
+/* Check the whole image against its CRC32 footer */
+static int verify_image(frogfs_fs_t *fs)
+{
+    frogfs_file_t f = { .fs = fs };
+    frogfs_verify_state_t st = { 0 };
+
+    if (fs->header->binary_len < sizeof(frogfs_crc32_footer_t)) {
+        LOGE(__func__, "image too short");
+        return -1;
+    }
+    uint32_t len = fs->header->binary_len - sizeof(frogfs_crc32_footer_t);
+
+    int ret = verify_range(&f, 0, len, &st, 0);
+    if (ret > 0) {
+        const frogfs_crc32_footer_t *footer = data_map(&f, len,
+                sizeof(frogfs_crc32_footer_t), NULL);
+        if (footer == NULL || footer->crc32 != st.crc) {
+            ret = -1;
+        }
+    }
+    data_unmap(&f);
+    if (ret <= 0) {
+        LOGE(__func__, "image checksum mismatch");
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK) || defined(CONFIG_FROGFS_USE_LZ4)
+/* Read a seek table entry. Both compression headers are followed by the
+ * table, and entries are relative to its end. */
+static bool seektable_get(frogfs_file_t *f, uint32_t block, uint32_t *offset)
+{
+    const frogfs_seektable_entry_t *entry = data_map(f,
+            f->fh->data_offset + sizeof(f->data_header) +
+            block * sizeof(frogfs_seektable_entry_t),
+            sizeof(frogfs_seektable_entry_t), NULL);
+    if (entry == NULL) {
+        return false;
+    }
+    *offset = entry->offset;
+    return true;
+}
+#endif
+
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+static const frogfs_heatshrink_header_t *heatshrink_header(
+        const frogfs_file_t *f)
+{
+    return &f->data_header.hsh;
+}
+
+static uint32_t heatshrink_num_blocks(const frogfs_file_t *f)
+{
+    const frogfs_heatshrink_header_t *hsh = heatshrink_header(f);
+
+    if (hsh->block_sz2 == 0) {
+        return 1;
+    }
+    return (f->fh->file_len + (1 << hsh->block_sz2) - 1) >> hsh->block_sz2;
+}
+
+/* Prime a freshly reset decoder's window with the image dictionary, as if
+ * its tail had just been decoded, for streams compressed against it. This
+ * writes the decoder's window and head_index directly, see the layout check
+ * at the top of this file. */
+static void heatshrink_prime(frogfs_file_t *f, heatshrink_decoder *hsd)
+{
+    const frogfs_heatshrink_header_t *hsh = heatshrink_header(f);
+    const frogfs_fs_header_t *header = f->fs->header;
+
+    if (!(hsh->flags & FROGFS_HEATSHRINK_DICT) || header->dict_len == 0) {
+        return;
+    }
+
+    /* the dictionary precedes the file data, so it is always mapped */
+    size_t len = header->dict_len;
+    if (len > 1 << hsh->window_sz2) {
+        len = 1 << hsh->window_sz2;
+    }
+    const uint8_t *dict = (const void *) header + header->dict_offset;
+    memcpy(&hsd->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd)],
+            dict + header->dict_len - len, len);
+    hsd->head_index = len;
+}
+
+static int decoder_pool_init(frogfs_fs_t *fs, const frogfs_config_t *conf)
+{
+    uint8_t window_sz2 = 0;
+    uint8_t lookahead_sz2 = 0;
+    frogfs_file_t f = { .fs = fs };
+
+    /* size the decoders for the largest parameters used in the image */
+    for (uint16_t i = 0; i < fs->header->num_objects; i++) {
+        const frogfs_file_header_t *fh = (const void *) fs->header +
+                fs->sorttable[i].offset;
+        if (fh->object.type != FROGFS_TYPE_FILE ||
+                fh->compression != FROGFS_COMPRESSION_HEATSHRINK) {
+            continue;
+        }
+        const frogfs_heatshrink_header_t *hsh = data_map(&f,
+                fh->data_offset, sizeof(frogfs_heatshrink_header_t), NULL);
+        if (hsh == NULL) {
+            data_unmap(&f);
+            return -1;
+        }
+        if (hsh->window_sz2 > window_sz2) {
+            window_sz2 = hsh->window_sz2;
+        }
+        if (hsh->lookahead_sz2 > lookahead_sz2) {
+            lookahead_sz2 = hsh->lookahead_sz2;
+        }
+    }
+    data_unmap(&f);
+
+    if (window_sz2 == 0) {
+        LOGD(__func__, "no heatshrink files, pool not needed");
+        return 0;
+    }
+
+    fs->decoders = calloc(conf->num_decoders, sizeof(heatshrink_decoder *));
+    if (fs->decoders == NULL) {
+        LOGE(__func__, "calloc failed");
+        return -1;
+    }
+
+#if defined(ESP_PLATFORM)
+    fs->decoder_queue = xQueueCreate(conf->num_decoders,
+            sizeof(heatshrink_decoder *));
+    if (fs->decoder_queue == NULL) {
+        LOGE(__func__, "xQueueCreate failed");
+        return -1;
+    }
+    fs->decoder_wait = pdMS_TO_TICKS(conf->decoder_wait_ms);
+#endif
+
+    for (fs->num_decoders = 0; fs->num_decoders < conf->num_decoders;
+            fs->num_decoders++) {
+        heatshrink_decoder *hsd = heatshrink_decoder_alloc(
+                CONFIG_FROGFS_HEATSHRINK_INPUT_BUFFER, window_sz2,
+                lookahead_sz2);
+        if (hsd == NULL) {
+            LOGE(__func__, "heatshrink_decoder_alloc");
+            return -1;
+        }
+        fs->decoders[fs->num_decoders] = hsd;
+#if defined(ESP_PLATFORM)
+        xQueueSend(fs->decoder_queue, &hsd, 0);
+#endif
+    }
+    fs->num_free_decoders = fs->num_decoders;
+
+    LOGD(__func__, "%d decoders, window_sz2 %d, lookahead_sz2 %d",
+            fs->num_decoders, window_sz2, lookahead_sz2);
+    return 0;
+}
+
+static void decoder_pool_deinit(frogfs_fs_t *fs)
+{
+    if (fs->decoders != NULL) {
+        for (int i = 0; i < fs->num_decoders; i++) {
+            heatshrink_decoder_free(fs->decoders[i]);
+        }
+        free(fs->decoders);
+    }
+#if defined(ESP_PLATFORM)
+    if (fs->decoder_queue != NULL) {
+        vQueueDelete(fs->decoder_queue);
+    }
+#endif
+}
+
+static heatshrink_decoder *decoder_get(frogfs_fs_t *fs,
+        const frogfs_heatshrink_header_t *hsh)
+{
+    heatshrink_decoder *hsd;
+
+    if (fs->decoders == NULL) {
+        LOGV(__func__, "heatshrink_decoder_alloc");
+        hsd = heatshrink_decoder_alloc(CONFIG_FROGFS_HEATSHRINK_INPUT_BUFFER,
+                hsh->window_sz2, hsh->lookahead_sz2);
+        if (hsd == NULL) {
+            LOGE(__func__, "heatshrink_decoder_alloc");
+            STATS_ADD(fs, decoder_failures, 1);
+            return NULL;
+        }
+        STATS_ADD(fs, decoder_allocs, 1);
+        return hsd;
+    }
+
+#if defined(ESP_PLATFORM)
+    if (xQueueReceive(fs->decoder_queue, &hsd, fs->decoder_wait) != pdTRUE) {
+        LOGE(__func__, "no free decoder");
+        STATS_ADD(fs, decoder_failures, 1);
+        return NULL;
+    }
+#else
+    if (fs->num_free_decoders == 0) {
+        LOGE(__func__, "no free decoder");
+        STATS_ADD(fs, decoder_failures, 1);
+        return NULL;
+    }
+    hsd = fs->decoders[--fs->num_free_decoders];
+#endif
+    STATS_ADD(fs, decoder_allocs, 1);
+
+    /* pool decoders are large enough for any stream in the image, so they
+     * only need their parameters set before they are reset, see the layout
+     * check at the top of this file */
+    hsd->window_sz2 = hsh->window_sz2;
+    hsd->lookahead_sz2 = hsh->lookahead_sz2;
+    heatshrink_decoder_reset(hsd);
+    return hsd;
+}
+
+static void decoder_put(frogfs_fs_t *fs, heatshrink_decoder *hsd)
+{
+    if (fs->decoders == NULL) {
+        LOGV(__func__, "heatshrink_decoder_free");
+        heatshrink_decoder_free(hsd);
+        return;
+    }
+
+#if defined(ESP_PLATFORM)
+    xQueueSend(fs->decoder_queue, &hsd, 0);
+#else
+    fs->decoders[fs->num_free_decoders++] = hsd;
+#endif
+}
+
+static heatshrink_decoder *heatshrink_open(frogfs_file_t *f)
+{
+    heatshrink_decoder *hsd = decoder_get(f->fs, heatshrink_header(f));
+    if (hsd == NULL) {
+        return NULL;
+    }
+
+    heatshrink_prime(f, hsd);
+    f->user = hsd;
+    f->raw_pos = f->raw_start;
+    return hsd;
+}
+#endif
+
+#if defined(CONFIG_FROGFS_USE_LZ4)
+typedef struct lz4_block_t {
+    uint32_t index; /* block held in data, or UINT32_MAX */
+    uint32_t len;
+    uint8_t data[];
+} lz4_block_t;
+
+static const frogfs_lz4_header_t *lz4_header(const frogfs_file_t *f)
+{
+    return &f->data_header.lzh;
+}
+
+static uint32_t lz4_num_blocks(const frogfs_file_t *f)
+{
+    const frogfs_lz4_header_t *lzh = lz4_header(f);
+
+    if (lzh->block_sz2 == 0) {
+        return 1;
+    }
+    return (f->fh->file_len + (1 << lzh->block_sz2) - 1) >> lzh->block_sz2;
+}
+
+/* Decode a complete LZ4 block format stream, returning the decoded length
+ * or -1 if it is malformed or does not fit */
+static ssize_t lz4_decode(const uint8_t *src, size_t src_len, uint8_t *dst,
+        size_t dst_len)
+{
+    const uint8_t *src_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *dst_end = dst + dst_len;
+
+    while (src < src_end) {
+        uint8_t token = *src++;
+
+        size_t len = token >> 4;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (src >= src_end) {
+                    return -1;
+                }
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > src_end - src || len > dst_end - op) {
+            return -1;
+        }
+        memcpy(op, src, len);
+        op += len;
+        src += len;
+
+        /* the last sequence has literals only */
+        if (src == src_end) {
+            break;
+        }
+
+        if (src_end - src < 2) {
+            return -1;
+        }
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+
+        len = token & 0xF;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (src >= src_end) {
+                    return -1;
+                }
+                b = *src++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;
+        if (len > dst_end - op) {
+            return -1;
+        }
+
+        const uint8_t *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            /* overlapping match repeats the last offset bytes */
+            while (len--) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+static lz4_block_t *lz4_load_block(frogfs_file_t *f, uint32_t block)
+{
+    const frogfs_lz4_header_t *lzh = lz4_header(f);
+    lz4_block_t *lb = f->user;
+
+    if (lb == NULL) {
+        size_t len = f->fh->file_len;
+        if (lzh->block_sz2 != 0 && len > (1 << lzh->block_sz2)) {
+            len = 1 << lzh->block_sz2;
+        }
+        lb = malloc(sizeof(lz4_block_t) + len);
+        if (lb == NULL) {
+            LOGE(__func__, "malloc failed");
+            STATS_ADD(f->fs, decoder_failures, 1);
+            return NULL;
+        }
+        STATS_ADD(f->fs, decoder_allocs, 1);
+        lb->index = UINT32_MAX;
+        f->user = lb;
+    }
+
+    if (lb->index == block) {
+        return lb;
+    }
+
+    uint32_t start = 0;
+    uint32_t end = f->raw_len;
+    uint32_t len = f->fh->file_len;
+    if (lzh->block_sz2 != 0) {
+        if (!seektable_get(f, block, &start) || (block + 1 <
+                lz4_num_blocks(f) && !seektable_get(f, block + 1, &end))) {
+            return NULL;
+        }
+        len -= block << lzh->block_sz2;
+        if (len > (1 << lzh->block_sz2)) {
+            len = 1 << lzh->block_sz2;
+        }
+    }
+
+    LOGV(__func__, "block %" PRIu32, block);
+    const uint8_t *src = data_map(f, f->raw_start + start, end - start, NULL);
+    if (src == NULL) {
+        return NULL;
+    }
+    STATS_ADD(f->fs, raw_bytes, end - start);
+    if (lz4_decode(src, end - start, lb->data, len) != len) {
+        LOGE(__func__, "corrupt lz4 block %" PRIu32, block);
+        lb->index = UINT32_MAX;
+        return NULL;
+    }
+    lb->index = block;
+    lb->len = len;
+    return lb;
+}
+#endif
+
+/* Release the decoder or block buffer of a compressed file */
+static void decoder_release(frogfs_file_t *f)
+{
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+    if (f->fh->compression == FROGFS_COMPRESSION_HEATSHRINK) {
+        heatshrink_decoder *hsd = f->user;
+        if (hsd != NULL) {
+            decoder_put(f->fs, hsd);
+        }
+    }
+#endif
+
+#if defined(CONFIG_FROGFS_USE_LZ4)
+    if (f->fh->compression == FROGFS_COMPRESSION_LZ4) {
+        free(f->user);
+    }
+#endif
+
+    f->user = NULL;
+}
+
+static void hot_lock(frogfs_fs_t *fs)
+{
+#if defined(ESP_PLATFORM)
+    xSemaphoreTake(fs->hot_lock, portMAX_DELAY);
+#endif
+}
+
+static void hot_unlock(frogfs_fs_t *fs)
+{
+#if defined(ESP_PLATFORM)
+    xSemaphoreGive(fs->hot_lock);
+#endif
+}
+
+static int hot_init(frogfs_fs_t *fs, const frogfs_config_t *conf)
+{
+    fs->hot_opens = calloc(fs->header->num_objects, sizeof(uint8_t));
+    if (fs->hot_opens == NULL) {
+        LOGE(__func__, "calloc failed");
+        return -1;
+    }
+
+#if defined(ESP_PLATFORM)
+    fs->hot_lock = xSemaphoreCreateMutex();
+    if (fs->hot_lock == NULL) {
+        LOGE(__func__, "xSemaphoreCreateMutex failed");
+        return -1;
+    }
+#endif
+
+    fs->hot_len = conf->hot_cache_len;
+    fs->hot_min_opens = conf->hot_cache_opens ? conf->hot_cache_opens :
+            HOT_CACHE_OPENS;
+    return 0;
+}
+
+static void hot_deinit(frogfs_fs_t *fs)
+{
+    for (int i = 0; i < fs->num_hot; i++) {
+        free(fs->hot[i].data);
+    }
+    free(fs->hot);
+    free(fs->hot_opens);
+
+#if defined(ESP_PLATFORM)
+    if (fs->hot_lock != NULL) {
+        vSemaphoreDelete(fs->hot_lock);
+    }
+#endif
+}
+
+static void *hot_alloc(size_t len)
+{
+#if defined(ESP_PLATFORM)
+    /* the copies are large and read sequentially, so keep them out of
+     * internal RAM when there is PSRAM */
+    return heap_caps_malloc_prefer(len, 2, MALLOC_CAP_SPIRAM |
+            MALLOC_CAP_8BIT, MALLOC_CAP_8BIT);
+#else
+    return malloc(len);
+#endif
+}
+
+static frogfs_hot_entry_t *hot_find(frogfs_fs_t *fs,
+        const frogfs_file_header_t *fh)
+{
+    for (int i = 0; i < fs->num_hot; i++) {
+        if (fs->hot[i].data_offset == fh->data_offset &&
+                fs->hot[i].compression == fh->compression) {
+            return &fs->hot[i];
+        }
+    }
+    return NULL;
+}
+
+/* Evict least recently used idle copies until len more bytes fit the budget,
+ * called with the lock held */
+static bool hot_evict(frogfs_fs_t *fs, uint32_t len)
+{
+    while (fs->hot_used + len > fs->hot_len) {
+        frogfs_hot_entry_t *lru = NULL;
+        for (int i = 0; i < fs->num_hot; i++) {
+            frogfs_hot_entry_t *e = &fs->hot[i];
+            if (e->refs == 0 && (lru == NULL || (int32_t) (e->last_use -
+                    lru->last_use) < 0)) {
+                lru = e;
+            }
+        }
+        if (lru == NULL) {
+            return false;
+        }
+
+        LOGV(__func__, "%s", local_path(fs, lru->index));
+        /* it has to earn its place again */
+        fs->hot_opens[lru->index] = 0;
+        fs->hot_used -= lru->len;
+        free(lru->data);
+        *lru = fs->hot[--fs->num_hot];
+    }
+    return true;
+}
+
+/* Add a decompressed copy, called with the lock held */
+static frogfs_hot_entry_t *hot_insert(frogfs_fs_t *fs,
+        const frogfs_file_header_t *fh, uint8_t *data, uint32_t len)
+{
+    if (!hot_evict(fs, len)) {
+        return NULL;
+    }
+
+    if (fs->num_hot == fs->max_hot) {
+        int max_hot = fs->max_hot ? fs->max_hot * 2 : 4;
+        frogfs_hot_entry_t *hot = realloc(fs->hot,
+                max_hot * sizeof(frogfs_hot_entry_t));
+        if (hot == NULL) {
+            LOGE(__func__, "realloc failed");
+            return NULL;
+        }
+        fs->hot = hot;
+        fs->max_hot = max_hot;
+    }
+
+    frogfs_hot_entry_t *e = &fs->hot[fs->num_hot++];
+    e->data = data;
+    e->len = len;
+    e->data_offset = fh->data_offset;
+    e->index = fh->object.index;
+    e->refs = 0;
+    e->compression = fh->compression;
+    fs->hot_used += len;
+    return e;
+}
+
+/* Start reading a file from its decompressed copy, called with the lock
+ * held */
+static void hot_use(frogfs_file_t *f, frogfs_hot_entry_t *e)
+{
+    e->refs++;
+    e->last_use = ++f->fs->hot_clock;
+    f->user = e->data;
+    f->hot = true;
+}
+
+/* Serve a compressed file from its decompressed copy, or once the file has
+ * been opened often enough, have hot_fill make one when it is first read */
+static void hot_attach(frogfs_file_t *f)
+{
+    frogfs_fs_t *fs = f->fs;
+    uint16_t index = f->fh->object.index;
+    uint32_t len = f->fh->file_len;
+
+    if (len == 0 || len > fs->hot_len) {
+        return;
+    }
+
+    hot_lock(fs);
+    frogfs_hot_entry_t *e = hot_find(fs, f->fh);
+    if (e == NULL) {
+        if (fs->hot_opens[index] < UINT8_MAX) {
+            fs->hot_opens[index]++;
+        }
+        f->hot_pending = fs->hot_opens[index] >= fs->hot_min_opens;
+    } else {
+        STATS_ADD(fs, hot_hits, 1);
+        hot_use(f, e);
+    }
+    hot_unlock(fs);
+}
+
+/* Decompress a file marked by hot_attach into the hot cache and read it from
+ * there, keeping its position. Files that are opened but never read, such as
+ * for revalidation, are not decompressed. */
+static void hot_fill(frogfs_file_t *f)
+{
+    frogfs_fs_t *fs = f->fs;
+    uint32_t len = f->fh->file_len;
+    uint32_t pos = f->file_pos;
+
+    f->hot_pending = false;
+    uint8_t *data = hot_alloc(len);
+    if (data == NULL) {
+        LOGD(__func__, "no memory for %" PRIu32 " bytes", len);
+        return;
+    }
+
+    /* decompress outside of the lock from the start of the file */
+    decoder_release(f);
+    f->file_pos = 0;
+    f->raw_pos = f->raw_start;
+    ssize_t n = frogfs_fread(f, data, len);
+    decoder_release(f);
+    f->file_pos = 0;
+    f->raw_pos = f->raw_start;
+    if (n != len) {
+        free(data);
+        frogfs_fseek(f, pos, SEEK_SET);
+        return;
+    }
+
+    hot_lock(fs);
+    /* another task may have beaten us to it */
+    frogfs_hot_entry_t *e = hot_find(fs, f->fh);
+    if (e != NULL) {
+        free(data);
+    } else {
+        e = hot_insert(fs, f->fh, data, len);
+        if (e == NULL) {
+            hot_unlock(fs);
+            free(data);
+            frogfs_fseek(f, pos, SEEK_SET);
+            return;
+        }
+        STATS_ADD(fs, hot_fills, 1);
+    }
+    hot_use(f, e);
+    hot_unlock(fs);
+    f->file_pos = pos;
+}
+
+static void hot_detach(frogfs_file_t *f)
+{
+    frogfs_fs_t *fs = f->fs;
+
+    hot_lock(fs);
+    frogfs_hot_entry_t *e = hot_find(fs, f->fh);
+    assert(e != NULL);
+    e->refs--;
+    hot_unlock(fs);
+    f->user = NULL;
+    f->hot = false;
+}
+
+/* Read the header, index tables and objects of an image that can't be
+ * mapped into memory, and set up the page cache for its file data */
+static int cache_init(frogfs_fs_t *fs, const frogfs_config_t *conf)
+{
+    frogfs_fs_header_t header;
+    if (!conf->read(conf->read_ctx, 0, &header, sizeof(header))) {
+        LOGE(__func__, "header read failed");
+        return -1;
+    }
+    if (header.magic != FROGFS_MAGIC ||
+            header.version_major != FROGFS_VERSION_MAJOR ||
+            header.payload_offset > header.binary_len) {
+        LOGE(__func__, "no supported frogfs image found");
+        return -1;
+    }
 
-#include <assert.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
+    fs->page_len = conf->cache_page_len ? conf->cache_page_len :
+            FROGFS_CACHE_PAGE_LEN;
+    if (fs->page_len & (fs->page_len - 1)) {
+        LOGE(__func__, "page length %" PRIu32 " is not a power of two",
+                fs->page_len);
+        return -1;
+    }
+
+    void *metadata = malloc(header.payload_offset);
+    if (metadata == NULL) {
+        LOGE(__func__, "malloc failed");
+        return -1;
+    }
+    fs->header = metadata;
+    fs->read = conf->read;
+    fs->read_ctx = conf->read_ctx;
+    if (!conf->read(conf->read_ctx, 0, metadata, header.payload_offset)) {
+        LOGE(__func__, "metadata read failed");
+        return -1;
+    }
+    fs->mapped_len = header.payload_offset;
 
+    int num_pages = conf->cache_pages ? conf->cache_pages :
+            FROGFS_CACHE_PAGES;
+    LOGD(__func__, "%" PRIu32 " bytes of metadata, %d pages of %" PRIu32
+            " bytes", fs->mapped_len, num_pages, fs->page_len);
+    return windows_init(fs, num_pages);
+}
 
 frogfs_fs_t *frogfs_init(frogfs_config_t *conf)
 {
@@ -42,7 +1158,12 @@ frogfs_fs_t *frogfs_init(frogfs_config_t *conf)
     LOGV(__func__, "%p", fs);
 
     fs->header = (frogfs_fs_header_t *)conf->addr;
-    if (fs->header == NULL) {
+    fs->mapped_len = UINT32_MAX;
+    if (fs->header == NULL && conf->read != NULL) {
+        if (cache_init(fs, conf) < 0) {
+            goto err_out;
+        }
+    } else if (fs->header == NULL) {
 #if defined (ESP_PLATFORM)
         esp_partition_subtype_t subtype = conf->part_label ?
                 ESP_PARTITION_SUBTYPE_ANY :
@@ -55,10 +1176,28 @@ frogfs_fs_t *frogfs_init(frogfs_config_t *conf)
             goto err_out;
         }
 
-        if (esp_partition_mmap(partition, 0, partition->size,
+        fs->mapped_len = partition->size;
+#if defined(CONFIG_FROGFS_USE_MMAP_WINDOWS)
+        frogfs_fs_header_t header;
+        if (esp_partition_read(partition, 0, &header, sizeof(header)) ==
+                ESP_OK && header.magic == FROGFS_MAGIC &&
+                header.version_major == FROGFS_VERSION_MAJOR &&
+                header.payload_offset < partition->size) {
+            /* keep only the tables and objects mapped, and map file data
+             * through windows as it is used */
+            if (windows_init(fs, CONFIG_FROGFS_MMAP_WINDOWS) < 0) {
+                goto err_out;
+            }
+            fs->partition = partition;
+            fs->mapped_len = header.payload_offset;
+        }
+#endif
+
+        if (esp_partition_mmap(partition, 0, fs->mapped_len,
                 SPI_FLASH_MMAP_DATA, (const void **)&fs->header,
                 &fs->mmap_handle) != ESP_OK) {
             LOGE(__func__, "mmap failed");
+            fs->header = NULL;
             goto err_out;
         }
 #else
@@ -78,9 +1217,93 @@ frogfs_fs_t *frogfs_init(frogfs_config_t *conf)
         goto err_out;
     }
 
-    fs->hashtable = (const void *) fs->header + fs->header->len;
-    fs->sorttable = (const void *) fs->hashtable +
-            (sizeof(frogfs_hashtable_entry_t) * fs->header->num_objects);
+    if (fs->mapped_len > fs->header->binary_len) {
+        fs->mapped_len = fs->header->binary_len;
+    }
+
+    size_t align = frogfs_get_align(fs);
+    if ((uintptr_t) fs->header % align != 0) {
+        LOGW(__func__, "image at %p is not aligned to %d bytes", fs->header,
+                (int) align);
+    }
+
+    /* images with a minimal perfect hash have no hash index */
+    if (fs->header->num_mph_buckets != 0) {
+        fs->sorttable = (const void *) fs->header + fs->header->len;
+        fs->mph_slots = (const void *) fs->sorttable +
+                (sizeof(frogfs_sorttable_entry_t) * fs->header->num_objects);
+        fs->mph_buckets = (const void *) fs->mph_slots +
+                (sizeof(frogfs_mph_slot_t) * fs->header->num_objects);
+    } else {
+        size_t prefixes_len = sizeof(frogfs_hash_prefix_entry_t) *
+                ((1 << fs->header->hash_prefix_sz2) + 1);
+        fs->hash_prefixes = (const void *) fs->header + fs->header->len;
+        fs->hashes = (const void *) fs->hash_prefixes +
+                (prefixes_len + 3) / 4 * 4;
+        fs->hash_refs = (const void *) fs->hashes +
+                (sizeof(frogfs_hash_entry_t) * fs->header->num_objects);
+        fs->sorttable = (const void *) fs->hash_refs +
+                (sizeof(frogfs_hash_ref_t) * fs->header->num_objects);
+    }
+
+    if (fs->header->len >= offsetof(frogfs_fs_header_t, crc_offset) +
+            sizeof(uint32_t) && fs->header->crc_offset != 0) {
+        fs->crcs = (const void *) fs->header + fs->header->crc_offset;
+        fs->verified = calloc(fs->header->num_objects / 32 + 1,
+                sizeof(uint32_t));
+        fs->corrupt = calloc(fs->header->num_objects / 32 + 1,
+                sizeof(uint32_t));
+        if (fs->verified == NULL || fs->corrupt == NULL) {
+            LOGE(__func__, "calloc failed");
+            goto err_out;
+        }
+    }
+
+    if (fs->header->len >= offsetof(frogfs_fs_header_t, base_crc32) +
+            sizeof(uint32_t) && fs->header->base_crc32 != 0) {
+        if (conf->base == NULL || conf->base->base != NULL) {
+            LOGE(__func__, "delta image needs a full base image");
+            goto err_out;
+        }
+        if (crc32_update(0, conf->base->header,
+                conf->base->header->payload_offset) !=
+                fs->header->base_crc32) {
+            LOGE(__func__, "delta image was not built against this base");
+            goto err_out;
+        }
+        if (fs->header->num_objects + conf->base->header->num_objects >
+                UINT16_MAX) {
+            LOGE(__func__, "too many objects in delta and base images");
+            goto err_out;
+        }
+        fs->base = conf->base;
+    } else if (conf->base != NULL) {
+        LOGE(__func__, "base given for an image that is not a delta");
+        goto err_out;
+    }
+
+    fs->verify = conf->verify;
+    if (fs->verify == FROGFS_VERIFY_IMAGE) {
+        if (verify_image(fs) < 0) {
+            goto err_out;
+        }
+        if (fs->verified != NULL) {
+            memset(fs->verified, 0xFF, (fs->header->num_objects / 32 + 1) *
+                    sizeof(uint32_t));
+        }
+    } else if (fs->verify == FROGFS_VERIFY_OPEN && fs->crcs == NULL) {
+        LOGW(__func__, "image has no file checksums to verify");
+    }
+
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+    if (conf->num_decoders > 0 && decoder_pool_init(fs, conf) < 0) {
+        goto err_out;
+    }
+#endif
+
+    if (conf->hot_cache_len > 0 && hot_init(fs, conf) < 0) {
+        goto err_out;
+    }
 
     return fs;
 
@@ -93,178 +1316,720 @@ void frogfs_deinit(frogfs_fs_t *fs)
 {
     LOGV(__func__, "%p", fs);
 
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+    decoder_pool_deinit(fs);
+#endif
+
+    hot_deinit(fs);
+    windows_deinit(fs);
+    free(fs->verified);
+    free(fs->corrupt);
+
 #if defined(ESP_PLATFORM)
     if (fs->mmap_handle) {
         spi_flash_munmap(fs->mmap_handle);
     }
-#endif
-    free(fs);
+#endif
+    if (fs->read != NULL) {
+        free((void *) fs->header);
+    }
+    free(fs);
+}
+
+size_t frogfs_get_align(frogfs_fs_t *fs)
+{
+    assert(fs != NULL);
+
+    return 1 << fs->header->align_sz2;
+}
+
+bool frogfs_get_stats(frogfs_fs_t *fs, frogfs_stats_t *stats)
+{
+    assert(fs != NULL);
+    assert(stats != NULL);
+
+#if defined(CONFIG_FROGFS_STATS)
+    /* counters are read one at a time, a snapshot taken while other tasks
+     * use the filesystem may be slightly inconsistent */
+    stats->lookups = __atomic_load_n(&fs->stats.lookups, __ATOMIC_RELAXED);
+    stats->lookup_misses = __atomic_load_n(&fs->stats.lookup_misses,
+            __ATOMIC_RELAXED);
+    stats->collisions = __atomic_load_n(&fs->stats.collisions,
+            __ATOMIC_RELAXED);
+    stats->opens = __atomic_load_n(&fs->stats.opens, __ATOMIC_RELAXED);
+    stats->open_files = __atomic_load_n(&fs->stats.open_files,
+            __ATOMIC_RELAXED);
+    stats->peak_open_files = __atomic_load_n(&fs->stats.peak_open_files,
+            __ATOMIC_RELAXED);
+    stats->decoder_allocs = __atomic_load_n(&fs->stats.decoder_allocs,
+            __ATOMIC_RELAXED);
+    stats->decoder_failures = __atomic_load_n(&fs->stats.decoder_failures,
+            __ATOMIC_RELAXED);
+    stats->seek_resets = __atomic_load_n(&fs->stats.seek_resets,
+            __ATOMIC_RELAXED);
+    stats->hot_hits = __atomic_load_n(&fs->stats.hot_hits, __ATOMIC_RELAXED);
+    stats->hot_fills = __atomic_load_n(&fs->stats.hot_fills,
+            __ATOMIC_RELAXED);
+    stats->raw_bytes = __atomic_load_n(&fs->stats.raw_bytes,
+            __ATOMIC_RELAXED);
+    stats->decoded_bytes = __atomic_load_n(&fs->stats.decoded_bytes,
+            __ATOMIC_RELAXED);
+    return true;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif
+}
+
+int frogfs_verify_step(frogfs_fs_t *fs, uint32_t budget_us)
+{
+    assert(fs != NULL);
+
+    if (fs->crcs == NULL) {
+        return 0;
+    }
+
+    int64_t deadline = time_us() + budget_us;
+    frogfs_verify_state_t *st = &fs->verify_state;
+    bool started = false;
+    int ret = 1;
+    for (; st->index < fs->header->num_objects; st->index++) {
+        const frogfs_object_header_t *object = (const void *) fs->header +
+                fs->sorttable[st->index].offset;
+        uint32_t bit = 1u << (st->index % 32);
+        if (object->type != FROGFS_TYPE_FILE ||
+                ((fs->verified[st->index / 32] |
+                fs->corrupt[st->index / 32]) & bit)) {
+            continue;
+        }
+        if (started && time_us() >= deadline) {
+            return ret;
+        }
+        started = true;
+
+        int res = verify_file(fs, st, deadline);
+        if (res == 0) {
+            return ret;
+        }
+        if (res < 0) {
+            ret = -1;
+        }
+        st->region = 0;
+        st->pos = 0;
+        st->crc = 0;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+const char *frogfs_get_path(frogfs_fs_t *fs, uint16_t index)
+{
+    assert(fs != NULL);
+
+    if (fs->base != NULL) {
+        /* the base image's objects are numbered first */
+        if (index < fs->base->header->num_objects) {
+            return local_path(fs->base, index);
+        }
+        index -= fs->base->header->num_objects;
+    }
+    return local_path(fs, index);
+}
+
+static uint32_t djb2_hash(const char *s)
+{
+    unsigned long hash = 5381;
+
+    while (*s) {
+        /* hash = hash * 33 ^ c */
+        hash = ((hash << 5) + hash) ^ *s++;
+    }
+
+    return hash;
+}
+
+static uint32_t fnv1a_hash(const char *s)
+{
+    uint32_t hash = 2166136261;
+
+    while (*s) {
+        hash ^= (uint8_t) *s++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static const void *find_object_mph(frogfs_fs_t *fs, const char *path,
+        uint32_t hash)
+{
+    LOGV(__func__, "hash %08" PRIx32, hash);
+    uint16_t bucket = fmix32(hash) % fs->header->num_mph_buckets;
+    uint32_t seed = fs->mph_buckets[bucket].seed;
+    uint32_t slot = fmix32(hash ^ (fnv1a_hash(path) + seed * 0x9E3779B9)) %
+            fs->header->num_objects;
+    LOGV(__func__, "bucket %d slot %" PRIu32, bucket, slot);
+
+    /* every path in the image has its own slot, so there is only one
+     * candidate to compare against */
+    const frogfs_object_header_t *object = (const void *) fs->header +
+            fs->mph_slots[slot].offset;
+    if (strcmp(path, (const char *) object + object->len) != 0) {
+        LOGV(__func__, "no match");
+        return NULL;
+    }
+
+    LOGV(__func__, "object %d", object->index);
+    return object;
+}
+
+/* Hash used by the hash index, FNV-1a with the murmur3 finalizer so that
+ * similar paths spread over the whole range, also returning the path's
+ * length */
+static uint32_t index_hash(const char *s, size_t *len)
+{
+    const char *p = s;
+    uint32_t hash = 2166136261;
+
+    while (*p) {
+        hash ^= (uint8_t) *p++;
+        hash *= 16777619;
+    }
+
+    *len = p - s;
+    return fmix32(hash);
+}
+
+static const void *find_object_hashed(frogfs_fs_t *fs, const char *path)
+{
+    size_t path_len;
+    uint32_t hash = index_hash(path, &path_len);
+    LOGV(__func__, "hash %08" PRIx32, hash);
+
+    /* search the hashes sharing the path's prefix for the first match,
+     * touching only the hash array */
+    uint8_t prefix_sz2 = fs->header->hash_prefix_sz2;
+    uint32_t prefix = prefix_sz2 ? hash >> (32 - prefix_sz2) : 0;
+    int first = fs->hash_prefixes[prefix].first;
+    int last = fs->hash_prefixes[prefix + 1].first;
+    while (first < last) {
+        int middle = first + (last - first) / 2;
+        if (fs->hashes[middle].hash < hash) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    /* walk through candidates, rejecting those of another length without
+     * reading their object */
+    int compared = 0;
+    for (; first < fs->header->num_objects &&
+            fs->hashes[first].hash == hash; first++) {
+        const frogfs_hash_ref_t *ref = fs->hash_refs + first;
+        if (ref->path_len != path_len) {
+            continue;
+        }
+        if (compared++ > 0) {
+            STATS_ADD(fs, collisions, 1);
+        }
+        const frogfs_object_header_t *object = (const void *) fs->header +
+                ref->offset;
+        if (strcmp(path, (const char *) object + object->len) == 0) {
+            LOGV(__func__, "object %d", object->index);
+            return object;
+        }
+    }
+
+    LOGV(__func__, "no match");
+    return NULL;
+}
+
+/* Look path up in this image's own index, returning tombstones too */
+static const void *find_local(frogfs_fs_t *fs, const char *path)
+{
+    if (fs->header->num_mph_buckets != 0) {
+        return find_object_mph(fs, path, djb2_hash(path));
+    }
+    return find_object_hashed(fs, path);
+}
+
+static const void *find_object(frogfs_fs_t *fs, const char *path)
+{
+    assert(fs != NULL);
+
+    while (*path == '/') {
+        path++;
+    }
+    LOGV(__func__, "%s", path);
+    STATS_ADD(fs, lookups, 1);
+
+    /* a delta image's objects and tombstones hide those of its base, each
+     * image is searched with its own index */
+    const frogfs_object_header_t *object = find_local(fs, path);
+    if (object == NULL && fs->base != NULL) {
+        object = find_local(fs->base, path);
+    }
+    if (object == NULL || object->type == FROGFS_TYPE_DELETED) {
+        STATS_ADD(fs, lookup_misses, 1);
+        return NULL;
+    }
+    return object;
+}
+
+/* Return the filesystem whose image holds obj: the base of a delta image for
+ * objects the delta doesn't replace */
+static frogfs_fs_t *object_fs(frogfs_fs_t *fs, const void *obj)
+{
+    if (fs->base != NULL && (obj < (const void *) fs->header ||
+            obj >= (const void *) fs->header + fs->header->payload_offset)) {
+        return fs->base;
+    }
+    return fs;
+}
+
+/* Fill stat for an object of the image of fs. A delta image numbers its
+ * objects after those of its base. */
+static void object_stat(frogfs_fs_t *fs, const frogfs_object_header_t *object,
+        frogfs_stat_t *stat)
+{
+    memset(stat, 0, sizeof(frogfs_stat_t));
+    stat->type = object->type;
+    stat->index = object->index;
+    if (fs->base != NULL) {
+        stat->index += fs->base->header->num_objects;
+    }
+    stat->obj = (const frogfs_obj_t *) object;
+    if (object->type == FROGFS_TYPE_FILE) {
+        const frogfs_file_header_t *fh = (const frogfs_file_header_t *) object;
+        stat->flags = fh->flags;
+        stat->compression = fh->compression;
+        stat->size = fh->file_len;
+    }
+}
+
+bool frogfs_stat(frogfs_fs_t *fs, const char *path, frogfs_stat_t *stat)
+{
+    assert(fs != NULL);
+
+    const frogfs_object_header_t *object = find_object(fs, path);
+    if (object == NULL) {
+        LOGD(__func__, "object not found: %s", path);
+        return false;
+    }
+
+    object_stat(object_fs(fs, object), object, stat);
+    return true;
+}
+
+bool frogfs_get_meta(frogfs_fs_t *fs, const frogfs_obj_t *obj,
+        frogfs_meta_t *meta)
+{
+    assert(fs != NULL);
+    assert(obj != NULL);
+    assert(meta != NULL);
+
+    memset(meta, 0, sizeof(frogfs_meta_t));
+
+    const frogfs_object_header_t *object = (const void *) obj;
+    if (object->type != FROGFS_TYPE_FILE || object->len <
+            sizeof(frogfs_file_header_t) + sizeof(frogfs_meta_header_t)) {
+        return false;
+    }
+
+    const frogfs_meta_header_t *mh = (const void *) object +
+            sizeof(frogfs_file_header_t);
+    const char *p = (const char *) (mh + 1);
+    if (mh->mime_type_len) {
+        meta->mime_type = p;
+        p += mh->mime_type_len;
+    }
+    if (mh->content_length_len) {
+        meta->content_length = p;
+        p += mh->content_length_len;
+    }
+    if (mh->etag_len) {
+        meta->etag = p;
+        p += mh->etag_len;
+    }
+    if (mh->cache_control_len) {
+        meta->cache_control = p;
+    }
+
+    return true;
+}
+
+bool frogfs_get_variant(frogfs_fs_t *fs, const frogfs_obj_t *obj, int index,
+        frogfs_variant_t *variant)
+{
+    assert(fs != NULL);
+    assert(obj != NULL);
+    assert(variant != NULL);
+
+    const frogfs_file_header_t *fh = (const void *) obj;
+    if (fh->object.type != FROGFS_TYPE_FILE || index < 0 ||
+            index >= fh->num_variants) {
+        return false;
+    }
+
+    const frogfs_variant_entry_t *entry = (const void *) fh +
+            fh->object.len + fh->object.path_len;
+    entry += index;
+
+    fs = object_fs(fs, obj);
+    variant->encoding = entry->encoding;
+    variant->data = NULL;
+    if (entry->offset + entry->len <= fs->mapped_len) {
+        variant->data = (const void *) fs->header + entry->offset;
+    }
+    variant->len = entry->len;
+    variant->crc32 = entry->crc32;
+    return true;
+}
+
+bool frogfs_get_segment(frogfs_fs_t *fs, const frogfs_obj_t *obj, int index,
+        frogfs_segment_t *segment)
+{
+    assert(fs != NULL);
+    assert(obj != NULL);
+    assert(segment != NULL);
+
+    const frogfs_file_header_t *fh = (const void *) obj;
+    if (fh->object.type != FROGFS_TYPE_FILE ||
+            !(fh->flags & FROGFS_FLAG_TEMPLATE)) {
+        return false;
+    }
+
+    const frogfs_template_header_t *th = (const void *) fh +
+            fh->object.len + fh->object.path_len +
+            fh->num_variants * sizeof(frogfs_variant_entry_t);
+    if (index < 0 || index >= th->num_segments) {
+        return false;
+    }
+
+    const frogfs_template_segment_t *entry = (const void *) (th + 1);
+    const char *names = (const char *) (entry + th->num_segments);
+    entry += index;
+
+    segment->type = entry->type;
+    segment->len = entry->len;
+    if (entry->type == FROGFS_SEGMENT_TOKEN) {
+        segment->offset = 0;
+        segment->token = names + entry->offset;
+    } else {
+        segment->offset = entry->offset;
+        segment->token = NULL;
+    }
+    return true;
+}
+
+bool frogfs_opendir(frogfs_fs_t *fs, const char *path, frogfs_dir_t *dir)
+{
+    assert(fs != NULL);
+    assert(path != NULL);
+    assert(dir != NULL);
+
+    while (*path == '/') {
+        path++;
+    }
+
+    memset(dir, 0, sizeof(frogfs_dir_t));
+    dir->fs = fs;
+
+    if (*path == '\0') {
+        /* the root directory has no object; its children come first */
+        dir->count = fs->header->root_child_count;
+        if (fs->base != NULL) {
+            dir->base_count = fs->base->header->root_child_count;
+        }
+        return true;
+    }
+
+    const frogfs_object_header_t *object = find_object(fs, path);
+    if (object == NULL || object->type != FROGFS_TYPE_DIR) {
+        LOGD(__func__, "directory not found: %s", path);
+        return false;
+    }
+
+    return frogfs_opendir_obj(fs, (const frogfs_obj_t *) object, dir);
 }
 
-const char *frogfs_get_path(frogfs_fs_t *fs, uint16_t index)
+bool frogfs_opendir_obj(frogfs_fs_t *fs, const frogfs_obj_t *obj,
+        frogfs_dir_t *dir)
 {
     assert(fs != NULL);
+    assert(obj != NULL);
+    assert(dir != NULL);
 
-    if (index >= fs->header->num_objects) {
-        return NULL;
+    const frogfs_object_header_t *object = (const void *) obj;
+    if (object->type != FROGFS_TYPE_DIR) {
+        LOGD(__func__, "object is not a directory");
+        return false;
     }
 
-    const frogfs_sorttable_entry_t *entry = fs->sorttable + index;
-    const frogfs_object_header_t *object = (const void *) fs->header +
-            entry->offset;
-    return (const char *) object + object->len;
+    memset(dir, 0, sizeof(frogfs_dir_t));
+    dir->fs = fs;
+
+    const frogfs_dir_header_t *dh = (const frogfs_dir_header_t *) object;
+    if (object_fs(fs, object) != fs) {
+        /* not in the delta, list the base directory */
+        dir->base_first = dh->child_index;
+        dir->base_count = dh->child_count;
+        return true;
+    }
+
+    dir->first = dh->child_index;
+    dir->count = dh->child_count;
+    if (fs->base != NULL) {
+        /* merge with the directory of the same path in the base */
+        object = find_object(fs->base, (const char *) object + object->len);
+        if (object != NULL && object->type == FROGFS_TYPE_DIR) {
+            dh = (const frogfs_dir_header_t *) object;
+            dir->base_first = dh->child_index;
+            dir->base_count = dh->child_count;
+        }
+    }
+    return true;
 }
 
-static uint32_t djb2_hash(const char *s)
+const char *frogfs_readdir(frogfs_dir_t *dir, frogfs_stat_t *stat)
 {
-    unsigned long hash = 5381;
+    assert(dir != NULL);
 
-    while (*s) {
-        /* hash = hash * 33 ^ c */
-        hash = ((hash << 5) + hash) ^ *s++;
+    frogfs_fs_t *fs = dir->fs;
+    const frogfs_object_header_t *object;
+    const char *path;
+
+    /* a delta image's directories list the base entries first, as replaced
+     * or hidden by the delta, followed by the entries the delta adds */
+    while (true) {
+        if (dir->pos >= dir->base_count + dir->count) {
+            return NULL;
+        }
+
+        uint16_t pos = dir->pos++;
+        if (pos < dir->base_count) {
+            const frogfs_sorttable_entry_t *entry = fs->base->sorttable +
+                    dir->base_first + pos;
+            object = (const void *) fs->base->header + entry->offset;
+            path = (const char *) object + object->len;
+            const frogfs_object_header_t *replaced = find_local(fs, path);
+            if (replaced != NULL) {
+                object = replaced;
+            }
+        } else {
+            const frogfs_sorttable_entry_t *entry = fs->sorttable +
+                    dir->first + pos - dir->base_count;
+            object = (const void *) fs->header + entry->offset;
+            path = (const char *) object + object->len;
+            if (fs->base != NULL && object->type != FROGFS_TYPE_DELETED &&
+                    find_local(fs->base, path) != NULL) {
+                /* already listed with the base entries */
+                continue;
+            }
+        }
+
+        if (object->type != FROGFS_TYPE_DELETED) {
+            break;
+        }
     }
 
-    return hash;
+    if (stat != NULL) {
+        object_stat(object_fs(fs, object), object, stat);
+    }
+
+    const char *name = strrchr(path, '/');
+    return name ? name + 1 : path;
 }
 
-static const void *find_object(frogfs_fs_t *fs, const char *path)
+uint16_t frogfs_telldir(frogfs_dir_t *dir)
 {
-    assert(fs != NULL);
+    assert(dir != NULL);
 
-    while (*path == '/') {
-        path++;
-    }
-    LOGV(__func__, "%s", path);
+    return dir->pos;
+}
 
-    uint32_t hash = djb2_hash(path);
-    LOGV(__func__, "hash %08" PRIx32, hash);
+void frogfs_seekdir(frogfs_dir_t *dir, uint16_t pos)
+{
+    assert(dir != NULL);
 
-    int first = 0;
-    int last = fs->header->num_objects - 1;
-    int middle;
-    const frogfs_hashtable_entry_t *entry;
+    uint16_t count = dir->base_count + dir->count;
+    dir->pos = pos < count ? pos : count;
+}
 
-    while (first <= last) {
-        middle = first + (last - first) / 2;
-        entry = fs->hashtable + middle;
-        if (entry->hash == hash) {
-            break;
-        } else if (entry->hash < hash) {
-            first = middle + 1;
-        } else {
-            last = middle - 1;
+static frogfs_file_t *file_init(frogfs_fs_t *fs,
+        const frogfs_file_header_t *fh, frogfs_file_t *f)
+{
+    memset(f, 0, sizeof(frogfs_file_t));
+
+    LOGV(__func__, "%p", f);
+
+    if (fs->crcs != NULL) {
+        uint16_t index = fh->object.index;
+        if (fs->corrupt[index / 32] & (1u << (index % 32))) {
+            LOGE(__func__, "%s failed verification",
+                    local_path(fs, index));
+            return NULL;
+        }
+        if (fs->verify == FROGFS_VERIFY_OPEN &&
+                !(fs->verified[index / 32] & (1u << (index % 32)))) {
+            frogfs_verify_state_t st = { .index = index };
+            if (verify_file(fs, &st, 0) < 0) {
+                return NULL;
+            }
         }
     }
 
-    if (first > last) {
-        LOGV(__func__, "no match");
-        return NULL;
+    f->fs = fs;
+    f->fh = fh;
+    f->raw_start = fh->data_offset;
+    f->raw_pos = f->raw_start;
+    f->raw_len = fh->data_len;
+
+    if (fh->compression == FROGFS_COMPRESSION_NONE) {
+        return f;
     }
 
-    /* be optimistic and test the first match */
-    frogfs_object_header_t *object = (void *) fs->header + entry->offset;
-    if (strcmp(path, (char *) object + object->len) == 0) {
-        LOGV(__func__, "object %d", middle);
-        return object;
+    /* keep a copy of the header, the data may be mapped elsewhere */
+    const void *header = data_map(f, fh->data_offset, sizeof(f->data_header),
+            NULL);
+    if (header == NULL) {
+        return NULL;
     }
+    memcpy(&f->data_header, header, sizeof(f->data_header));
+    data_unmap(f);
 
-    /* hash collision, move entry to the first match */
-    LOGV(__func__, "hash collision");
-    int skip = middle;
-    while (middle > 0) {
-        entry = fs->hashtable + middle;
-        if ((entry - 1)->hash != hash) {
-            break;
+    uint8_t block_sz2;
+    switch (fh->compression) {
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+    case FROGFS_COMPRESSION_HEATSHRINK:
+        /* an unknown flag changes how the stream decodes, so refuse it
+         * rather than return corrupted data */
+        if (f->data_header.hsh.flags & ~FROGFS_HEATSHRINK_DICT) {
+            LOGE(__func__, "unsupported heatshrink flags %02x",
+                    f->data_header.hsh.flags);
+            return NULL;
         }
-        middle--;
+        block_sz2 = f->data_header.hsh.block_sz2;
+        break;
+#endif
+#if defined(CONFIG_FROGFS_USE_LZ4)
+    case FROGFS_COMPRESSION_LZ4:
+        block_sz2 = f->data_header.lzh.block_sz2;
+        break;
+#endif
+    default:
+        LOGE(__func__, "unrecognized compression type %d", fh->compression);
+        return NULL;
     }
 
-    /* walk through canidates and look for a match */
-    do {
-        if (middle != skip) {
-            object = (void *) fs->header + entry->offset;
-            if (strcmp(path, (const char *) object + object->len) == 0) {
-                LOGV(__func__, "object %d", middle);
-                return object;
-            }
-        }
-        entry++;
-        middle++;
-    } while ((middle < fs->header->num_objects) && (entry->hash == hash));
+    /* the stream follows the header and its seek table, if any; decoders
+     * and block buffers are allocated on first use */
+    uint32_t header_len = sizeof(f->data_header);
+    if (block_sz2 != 0) {
+        header_len += sizeof(frogfs_seektable_entry_t) *
+                ((fh->file_len + (1 << block_sz2) - 1) >> block_sz2);
+    }
+    f->raw_start += header_len;
+    f->raw_pos = f->raw_start;
+    f->raw_len -= header_len;
 
-    LOGW(__func__, "unable to find object");
-    return NULL;
+    if (fs->hot_len != 0) {
+        hot_attach(f);
+    }
+    return f;
 }
 
-bool frogfs_stat(frogfs_fs_t *fs, const char *path, frogfs_stat_t *stat)
+// Open a file and return a pointer to the file desc struct.
+frogfs_file_t *frogfs_fopen(frogfs_fs_t *fs, const char *path)
 {
     assert(fs != NULL);
 
     const frogfs_object_header_t *object = find_object(fs, path);
     if (object == NULL) {
-        LOGD(__func__, "object not found: %s", path);
-        return false;
-    }
-
-    memset(stat, 0, sizeof(frogfs_stat_t));
-    stat->type = object->type;
-    stat->index = object->index;
-    if (object->type == FROGFS_TYPE_FILE) {
-        const frogfs_file_header_t *fh = (const frogfs_file_header_t *) object;
-        stat->flags = fh->flags;
-        stat->compression = fh->compression;
-        stat->size = fh->file_len;
+        LOGD(__func__, "file not found: %s", path);
+        return NULL;
     }
 
-    return true;
+    return frogfs_fopen_obj(fs, (const frogfs_obj_t *) object);
 }
 
-// Open a file and return a pointer to the file desc struct.
-frogfs_file_t *frogfs_fopen(frogfs_fs_t *fs, const char *path)
+// Open a file into caller provided storage.
+frogfs_file_t *frogfs_fopen_into(frogfs_fs_t *fs, const char *path,
+        frogfs_file_storage_t *storage)
 {
     assert(fs != NULL);
 
     const frogfs_object_header_t *object = find_object(fs, path);
-    if ((object == NULL) || (object->type != FROGFS_TYPE_FILE)) {
+    if (object == NULL) {
         LOGD(__func__, "file not found: %s", path);
         return NULL;
     }
 
-    const frogfs_file_header_t *fh = (const frogfs_file_header_t *) object;
+    return frogfs_fopen_obj_into(fs, (const frogfs_obj_t *) object, storage);
+}
+
+// Open a file by object reference.
+frogfs_file_t *frogfs_fopen_obj(frogfs_fs_t *fs, const frogfs_obj_t *obj)
+{
+    assert(fs != NULL);
+    assert(obj != NULL);
+
+    const frogfs_object_header_t *object = (const void *) obj;
+    if (object->type != FROGFS_TYPE_FILE) {
+        LOGD(__func__, "object %d is not a file", object->index);
+        return NULL;
+    }
 
     frogfs_file_t *f = malloc(sizeof(frogfs_file_t));
     if (f == NULL) {
         LOGE(__func__, "malloc failed");
-        goto err_out;
+        return NULL;
     }
-    memset(f, 0, sizeof(frogfs_file_t));
 
-    LOGV(__func__, "%p", f);
+    fs = object_fs(fs, object);
+    if (file_init(fs, (const frogfs_file_header_t *) object, f) == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->allocated = true;
+    stats_open(fs);
 
-    f->fs = fs;
-    f->fh = fh;
+    return f;
+}
 
-    if (fh->compression == FROGFS_COMPRESSION_NONE) {
-        f->raw_start = (void *) object + object->len + object->path_len;
-        f->raw_ptr = f->raw_start;
-        f->raw_len = fh->data_len;
-    } else
-#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
-    if (f->fh->compression == FROGFS_COMPRESSION_HEATSHRINK) {
-        /* defer initialization until use */
-    } else
-#endif
-    {
-        LOGE(__func__, "unrecognized compression type %d",
-                fh->compression);
-        goto err_out;
+// Open a file by object reference into caller provided storage.
+frogfs_file_t *frogfs_fopen_obj_into(frogfs_fs_t *fs, const frogfs_obj_t *obj,
+        frogfs_file_storage_t *storage)
+{
+    assert(fs != NULL);
+    assert(obj != NULL);
+    assert(storage != NULL);
+    _Static_assert(sizeof(frogfs_file_t) <= sizeof(frogfs_file_storage_t),
+            "frogfs_file_storage_t is too small");
+
+    const frogfs_object_header_t *object = (const void *) obj;
+    if (object->type != FROGFS_TYPE_FILE) {
+        LOGD(__func__, "object %d is not a file", object->index);
+        return NULL;
     }
 
+    fs = object_fs(fs, object);
+    frogfs_file_t *f = file_init(fs, (const frogfs_file_header_t *) object,
+            (frogfs_file_t *) storage);
+    if (f != NULL) {
+        stats_open(fs);
+    }
     return f;
-
-err_out:
-    frogfs_fclose(f);
-    return NULL;
 }
 
 // Close the file.
@@ -277,29 +2042,34 @@ void frogfs_fclose(frogfs_file_t *f)
 
     LOGV(__func__, "%p", f);
 
-#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
-    if (f->fh->compression == FROGFS_COMPRESSION_HEATSHRINK) {
-        heatshrink_decoder *hsd = f->user;
-        if (hsd != NULL) {
-            LOGV(__func__, "heatshrink_decoder_free");
-            heatshrink_decoder_free(hsd);
-        }
+    if (f->hot) {
+        hot_detach(f);
+    } else {
+        decoder_release(f);
     }
-#endif
 
-    free(f);
+    data_unmap(f);
+    STATS_ADD(f->fs, open_files, -1);
+
+    if (f->allocated) {
+        free(f);
+    }
 }
 
 void frogfs_fstat(frogfs_file_t *f, frogfs_stat_t *stat)
 {
     assert(f != NULL);
 
-    memset(stat, 0, sizeof(frogfs_stat_t));
-    stat->type = f->fh->object.type;
-    stat->index = f->fh->object.index;
-    stat->flags = f->fh->flags;
-    stat->compression = f->fh->compression;
-    stat->size = f->fh->file_len;
+    object_stat(f->fs, &f->fh->object, stat);
+}
+
+static bool copy_sink(void *user, const void *buf, size_t len)
+{
+    uint8_t **dst = user;
+
+    memcpy(*dst, buf, len);
+    *dst += len;
+    return true;
 }
 
 // Read len bytes from the given file into buf. Returns the actual amount of bytes read.
@@ -307,19 +2077,18 @@ ssize_t frogfs_fread(frogfs_file_t *f, void *buf, size_t len)
 {
     assert(f != NULL);
 
-    if (f->fh->compression == FROGFS_COMPRESSION_NONE) {
-        size_t remaining = f->fh->file_len - (f->raw_ptr - f->raw_start);
-        if (len > remaining) {
-            len = remaining;
-        }
-        memcpy(buf, f->raw_ptr, len);
-        f->file_pos += len;
-        f->raw_ptr += len;
-        return len;
+    if (f->hot_pending) {
+        hot_fill(f);
+    }
+    if (f->hot || f->fh->compression == FROGFS_COMPRESSION_NONE ||
+            f->fh->compression == FROGFS_COMPRESSION_LZ4) {
+        /* the data is already addressable, so copy it out as it's piped */
+        return frogfs_fpipe(f, len, NULL, 0, copy_sink, &buf);
     }
 
 #if defined(CONFIG_FROGFS_USE_HEATSHRINK)
     if (f->fh->compression == FROGFS_COMPRESSION_HEATSHRINK) {
+        const frogfs_heatshrink_header_t *hsh = heatshrink_header(f);
         size_t decoded = 0;
         size_t rlen;
 
@@ -329,37 +2098,55 @@ ssize_t frogfs_fread(frogfs_file_t *f, void *buf, size_t len)
 
         heatshrink_decoder *hsd = (heatshrink_decoder *) f->user;
         if (hsd == NULL) {
-            frogfs_heatshrink_header_t *hsh = (void *) &f->fh->object +
-                    f->fh->object.len + f->fh->object.path_len;
-            LOGV(__func__, "heatshrink_decoder_alloc");
-            hsd = heatshrink_decoder_alloc(16, hsh->window_sz2,
-                    hsh->lookahead_sz2);
+            hsd = heatshrink_open(f);
             if (hsd == NULL) {
-                LOGE(__func__, "heatshrink_decoder_alloc");
                 return -1;
             }
-
-            f->user = hsd;
-            f->raw_start = (void *) hsh + sizeof(frogfs_heatshrink_header_t);
-            f->raw_ptr = f->raw_start;
-            f->raw_len = f->fh->data_len - sizeof(frogfs_heatshrink_header_t);
         }
 
         while (decoded < len) {
-            /* feed data into the decoder */
-            size_t remain = f->raw_len - (f->raw_ptr - f->raw_start);
+            /* find the end of the current block, or the whole stream */
+            uint32_t block_end = f->fh->file_len;
+            uint32_t raw_end = f->raw_start + f->raw_len;
+            if (hsh->block_sz2 != 0) {
+                uint32_t block = (f->file_pos >> hsh->block_sz2) + 1;
+                if (block < heatshrink_num_blocks(f)) {
+                    uint32_t offset;
+                    if (!seektable_get(f, block, &offset)) {
+                        return -1;
+                    }
+                    block_end = block << hsh->block_sz2;
+                    raw_end = f->raw_start + offset;
+                }
+            }
+
+            /* feed as much data as the decoder will take */
+            uint32_t remain = raw_end - f->raw_pos;
             if (remain > 0) {
-                HSD_sink_res res = heatshrink_decoder_sink(hsd, f->raw_ptr,
-                        (remain > 16) ? 16 : remain, &rlen);
+                uint32_t avail;
+                const void *p = data_map(f, f->raw_pos, 1, &avail);
+                if (p == NULL) {
+                    return -1;
+                }
+                if (remain > avail) {
+                    remain = avail;
+                }
+                HSD_sink_res res = heatshrink_decoder_sink(hsd, (uint8_t *) p,
+                        remain, &rlen);
                 if (res < 0) {
                     LOGE(__func__, "heatshrink_decoder_sink");
                     return -1;
                 }
-                f->raw_ptr += rlen;
+                f->raw_pos += rlen;
+                STATS_ADD(f->fs, raw_bytes, rlen);
             }
 
+            size_t want = len - decoded;
+            if (want > block_end - f->file_pos) {
+                want = block_end - f->file_pos;
+            }
             HSD_poll_res res = heatshrink_decoder_poll(hsd, (uint8_t *) buf,
-                    len - decoded, &rlen);
+                    want, &rlen);
             if (res < 0) {
                 LOGE(__func__, "heatshrink_decoder_poll");
                 return -1;
@@ -368,25 +2155,139 @@ ssize_t frogfs_fread(frogfs_file_t *f, void *buf, size_t len)
             buf += rlen;
             decoded += rlen;
 
-            if (remain == 0) {
-                if (f->file_pos == f->fh->file_len) {
-                    HSD_finish_res res = heatshrink_decoder_finish(hsd);
-                    if (res < 0) {
-                        LOGE(__func__, "heatshrink_decoder_finish");
-                        return -1;
-                    }
-                    LOGV(__func__, "heatshrink_decoder_finish");
+            if (f->file_pos == f->fh->file_len) {
+                HSD_finish_res res = heatshrink_decoder_finish(hsd);
+                if (res < 0) {
+                    LOGE(__func__, "heatshrink_decoder_finish");
+                    return -1;
                 }
-                return decoded;
+                LOGV(__func__, "heatshrink_decoder_finish");
+                break;
+            }
+
+            if (f->file_pos == block_end) {
+                /* blocks are independent streams, start the next one */
+                heatshrink_decoder_reset(hsd);
+                heatshrink_prime(f, hsd);
+                f->raw_pos = raw_end;
+            } else if (remain == 0 && res == HSDR_POLL_EMPTY) {
+                LOGE(__func__, "unexpected end of data");
+                break;
             }
         }
-        return len;
+        STATS_ADD(f->fs, decoded_bytes, decoded);
+        return decoded;
     }
 #endif
 
     return -1;
 }
 
+// Pass up to len bytes from the given file to sink, chunk by chunk.
+ssize_t frogfs_fpipe(frogfs_file_t *f, size_t len, void *buf, size_t buf_len,
+        frogfs_sink_t sink, void *user)
+{
+    assert(f != NULL);
+    assert(sink != NULL);
+
+    if (f->hot_pending) {
+        hot_fill(f);
+    }
+    if (f->file_pos >= f->fh->file_len) {
+        return 0;
+    }
+    if (len > f->fh->file_len - f->file_pos) {
+        len = f->fh->file_len - f->file_pos;
+    }
+    size_t done = 0;
+
+    if (f->hot) {
+        if (!sink(user, (const uint8_t *) f->user + f->file_pos, len)) {
+            return -1;
+        }
+        f->file_pos += len;
+        STATS_ADD(f->fs, decoded_bytes, len);
+        return len;
+    }
+
+    if (f->fh->compression == FROGFS_COMPRESSION_NONE) {
+        /* with windowed mapping the data may be split over windows */
+        while (done < len) {
+            uint32_t avail;
+            const void *p = data_map(f, f->raw_pos, 1, &avail);
+            if (p == NULL) {
+                return -1;
+            }
+            if (avail > len - done) {
+                avail = len - done;
+            }
+            if (!sink(user, p, avail)) {
+                return -1;
+            }
+            done += avail;
+            f->file_pos += avail;
+            f->raw_pos += avail;
+        }
+        STATS_ADD(f->fs, raw_bytes, done);
+        STATS_ADD(f->fs, decoded_bytes, done);
+        return done;
+    }
+
+#if defined(CONFIG_FROGFS_USE_LZ4)
+    if (f->fh->compression == FROGFS_COMPRESSION_LZ4) {
+        /* blocks are decoded whole, pass them on from the block buffer */
+        const frogfs_lz4_header_t *lzh = lz4_header(f);
+
+        while (done < len) {
+            uint32_t block = 0;
+            if (lzh->block_sz2 != 0) {
+                block = f->file_pos >> lzh->block_sz2;
+            }
+            lz4_block_t *lb = lz4_load_block(f, block);
+            if (lb == NULL) {
+                return -1;
+            }
+
+            size_t offset = f->file_pos - (block << lzh->block_sz2);
+            size_t n = lb->len - offset;
+            if (n > len - done) {
+                n = len - done;
+            }
+            if (!sink(user, lb->data + offset, n)) {
+                return -1;
+            }
+            done += n;
+            f->file_pos += n;
+        }
+        STATS_ADD(f->fs, decoded_bytes, done);
+        return done;
+    }
+#endif
+
+    /* streams are decoded straight into the caller's window */
+    if (buf == NULL || buf_len == 0) {
+        LOGE(__func__, "no output window for compressed file");
+        return -1;
+    }
+    while (done < len) {
+        size_t want = len - done;
+        if (want > buf_len) {
+            want = buf_len;
+        }
+        ssize_t n = frogfs_fread(f, buf, want);
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        if (!sink(user, buf, n)) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
 // Seek in the file.
 ssize_t frogfs_fseek(frogfs_file_t *f, long offset, int mode)
 {
@@ -435,36 +2336,76 @@ ssize_t frogfs_fseek(frogfs_file_t *f, long offset, int mode)
         return -1;
     }
 
+    if (f->hot) {
+        /* the whole file is in memory */
+        f->file_pos = new_pos;
+        return f->file_pos;
+    }
+
     if (f->fh->compression == FROGFS_COMPRESSION_NONE) {
         f->file_pos = new_pos;
-        f->raw_ptr = f->raw_start + new_pos;
+        f->raw_pos = f->raw_start + new_pos;
+    }
+
+#if defined(CONFIG_FROGFS_USE_LZ4)
+    if (f->fh->compression == FROGFS_COMPRESSION_LZ4) {
+        /* blocks are decoded whole on demand, so seeking is free */
+        f->file_pos = new_pos;
     }
+#endif
 
 #if defined(CONFIG_FROGFS_USE_HEATSHRINK)
     if (f->fh->compression == FROGFS_COMPRESSION_HEATSHRINK) {
+        const frogfs_heatshrink_header_t *hsh = heatshrink_header(f);
         heatshrink_decoder *hsd = (heatshrink_decoder *) f->user;
 
-        if (new_pos < f->file_pos) {
-            if (hsd != NULL) {
-                LOGV(__func__, "heatshrink_decoder_reset");
-                heatshrink_decoder_reset(hsd);
-            }
-            f->file_pos = 0;
+        if (new_pos == f->fh->file_len) {
+            /* the decoder is restarted by the next backwards seek */
+            f->file_pos = new_pos;
+            return f->file_pos;
         }
 
-        if (f->file_pos == 0) {
-            f->raw_ptr = f->raw_start;
+        if (new_pos == f->file_pos) {
+            return f->file_pos;
         }
 
-        if (new_pos == f->fh->file_len) {
-            f->file_pos = new_pos;
-            f->raw_ptr = f->raw_start + f->raw_len;
-            return f->file_pos;
+        if (hsd == NULL) {
+            hsd = heatshrink_open(f);
+            if (hsd == NULL) {
+                return -1;
+            }
+        }
+
+        /* restart at the nearest block if it is not ahead of us */
+        uint32_t block = 0;
+        if (hsh->block_sz2 != 0) {
+            block = new_pos >> hsh->block_sz2;
+        }
+        uint32_t block_pos = block << hsh->block_sz2;
+        if (new_pos < f->file_pos || block_pos > f->file_pos) {
+            LOGV(__func__, "heatshrink_decoder_reset");
+            uint32_t offset = 0;
+            if (hsh->block_sz2 != 0 && !seektable_get(f, block, &offset)) {
+                return -1;
+            }
+            if (new_pos < f->file_pos) {
+                STATS_ADD(f->fs, seek_resets, 1);
+            }
+            heatshrink_decoder_reset(hsd);
+            heatshrink_prime(f, hsd);
+            f->file_pos = block_pos;
+            f->raw_pos = f->raw_start + offset;
         }
 
         while (new_pos > f->file_pos) {
-            uint8_t buf[16];
-            frogfs_fread(f, buf, sizeof(buf));
+            uint8_t buf[SEEK_SKIP_LEN];
+            size_t skip = new_pos - f->file_pos;
+            if (skip > sizeof(buf)) {
+                skip = sizeof(buf);
+            }
+            if (frogfs_fread(f, buf, skip) <= 0) {
+                return -1;
+            }
         }
     }
 #endif
@@ -479,13 +2420,58 @@ size_t frogfs_ftell(frogfs_file_t *f)
     return f->file_pos;
 }
 
+/* Map data for raw access, unless it would grow a read cache page past the
+ * page length */
+static const void *raw_map(frogfs_file_t *f, uint32_t offset, uint32_t len)
+{
+    if (f->fs->read != NULL && offset + len > f->fs->mapped_len &&
+            len > f->fs->page_len) {
+        LOGD(__func__, "%" PRIu32 " bytes do not fit a cache page", len);
+        return NULL;
+    }
+    return data_map(f, offset, len, NULL);
+}
+
 ssize_t frogfs_faccess(frogfs_file_t *f, void **buf)
 {
     assert(f != NULL);
 
+    if (f->hot_pending) {
+        hot_fill(f);
+    }
+    if (f->hot) {
+        *buf = f->user;
+        return f->fh->file_len;
+    }
     if (f->fh->compression != FROGFS_COMPRESSION_NONE) {
         return -1;
     }
-    *buf = f->raw_start;
+    const void *p = raw_map(f, f->raw_start, f->fh->file_len);
+    if (p == NULL) {
+        return -1;
+    }
+    *buf = (void *) p;
     return f->fh->file_len;
 }
+
+ssize_t frogfs_faccess_variant(frogfs_file_t *f, int index, void **buf)
+{
+    assert(f != NULL);
+
+    frogfs_variant_t variant;
+    if (!frogfs_get_variant(f->fs, (const frogfs_obj_t *) f->fh, index,
+            &variant)) {
+        return -1;
+    }
+    if (variant.data == NULL) {
+        /* not permanently mapped, map it for this file */
+        const frogfs_variant_entry_t *entry = (const void *) f->fh +
+                f->fh->object.len + f->fh->object.path_len;
+        variant.data = raw_map(f, entry[index].offset, variant.len);
+        if (variant.data == NULL) {
+            return -1;
+        }
+    }
+    *buf = (void *) variant.data;
+    return variant.len;
+}
@@ -4,33 +4,140 @@
 
 #pragma once
 
+#include "frogfs/frogfs.h"
 #include "frogfs/frogfs_format.h"
 
 #if defined(ESP_PLATFORM)
+#include "esp_partition.h"
 #include "spi_flash_mmap.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
 
 
+#ifndef CONFIG_FROGFS_MMAP_WINDOWS
+# define CONFIG_FROGFS_MMAP_WINDOWS 4
+#endif
+
+#ifndef CONFIG_FROGFS_MMAP_WINDOW_SIZE
+# define CONFIG_FROGFS_MMAP_WINDOW_SIZE 65536
+#endif
+
+#define FROGFS_CACHE_PAGES (4)
+#define FROGFS_CACHE_PAGE_LEN (4096)
+
 typedef struct frogfs_fs_t frogfs_fs_t;
 typedef struct frogfs_file_t frogfs_file_t;
+typedef struct frogfs_window_t frogfs_window_t;
+typedef struct frogfs_verify_state_t frogfs_verify_state_t;
+typedef struct frogfs_hot_entry_t frogfs_hot_entry_t;
+
+/* A flash mapping or read cache page of part of the file data, shared by the
+ * open files that reference it */
+struct frogfs_window_t {
+#if defined(ESP_PLATFORM)
+    spi_flash_mmap_handle_t handle;
+#endif
+    const uint8_t *addr; /* NULL if unused */
+    uint32_t offset;
+    uint32_t len;
+    uint32_t last_use;
+    uint16_t refs;
+    void *buf; /* page buffer, if read through the cache */
+    uint32_t buf_len;
+};
+
+/* Progress of a file's verification; region 0 is the file data, followed by
+ * each variant */
+struct frogfs_verify_state_t {
+    uint16_t index;
+    uint8_t region;
+    uint32_t pos;
+    uint32_t crc;
+};
+
+/* A decompressed copy of a frequently opened file, shared by the open files
+ * that read from it. It is keyed by the file's data rather than its object,
+ * so duplicate files that share their data share the copy too. */
+struct frogfs_hot_entry_t {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t last_use;
+    uint32_t data_offset;
+    uint16_t index; /* the object that made the copy */
+    uint16_t refs;
+    uint8_t compression;
+};
 
 struct frogfs_fs_t {
 #if defined(ESP_PLATFORM)
     spi_flash_mmap_handle_t mmap_handle;
+    const esp_partition_t *partition; /* set if file data uses mmap windows */
+    SemaphoreHandle_t window_lock;
 #endif
+    frogfs_read_t read; /* set if the image is read through the cache */
+    void *read_ctx;
+    uint32_t page_len;
+    frogfs_window_t *windows;
+    int num_windows;
+    uint32_t window_clock;
     const frogfs_fs_header_t *header;
-    const frogfs_hashtable_entry_t *hashtable;
+    uint32_t mapped_len; /* bytes of the image at header */
+    frogfs_fs_t *base; /* image a delta image is mounted on, or NULL */
+    const frogfs_hash_prefix_entry_t *hash_prefixes; /* NULL with an MPH */
+    const frogfs_hash_entry_t *hashes;
+    const frogfs_hash_ref_t *hash_refs;
     const frogfs_sorttable_entry_t *sorttable;
+    const frogfs_mph_slot_t *mph_slots;
+    const frogfs_mph_bucket_t *mph_buckets;
+    const frogfs_crc_entry_t *crcs; /* NULL if the image has no checksums */
+    frogfs_verify_t verify;
+    uint32_t *verified; /* bitmap of files that passed verification */
+    uint32_t *corrupt; /* bitmap of files that failed verification */
+    frogfs_verify_state_t verify_state; /* frogfs_verify_step progress */
+#if defined(CONFIG_FROGFS_STATS)
+    frogfs_stats_t stats; /* updated with relaxed atomics */
+#endif
+    frogfs_hot_entry_t *hot;
+    int num_hot;
+    int max_hot; /* allocated entries */
+    uint32_t hot_len; /* byte budget, 0 if the hot cache is disabled */
+    uint32_t hot_used;
+    uint32_t hot_clock;
+    uint8_t *hot_opens; /* saturating open count per object */
+    uint8_t hot_min_opens;
+#if defined(ESP_PLATFORM)
+    SemaphoreHandle_t hot_lock;
+#endif
+#if defined(CONFIG_FROGFS_USE_HEATSHRINK)
+    void **decoders;
+    int num_decoders;
+    int num_free_decoders;
+# if defined(ESP_PLATFORM)
+    QueueHandle_t decoder_queue;
+    TickType_t decoder_wait;
+# endif
+#endif
 };
 
 struct frogfs_file_t {
-    const frogfs_fs_t *fs;
+    frogfs_fs_t *fs;
     const frogfs_file_header_t *fh;
-    uint8_t *raw_start;
-    uint8_t *raw_ptr;
+    uint32_t raw_start; /* image offset of the compressed stream */
+    uint32_t raw_pos; /* image offset of the next byte to decode */
     uint32_t raw_len;
     uint32_t file_pos;
     void *user;
+    frogfs_window_t *window; /* window holding the last mapped data */
+    union {
+        frogfs_heatshrink_header_t hsh;
+        frogfs_lz4_header_t lzh;
+    } data_header; /* copy of the compression header */
+    bool allocated;
+    bool hot; /* user points to a hot cache copy of the file */
+    bool hot_pending; /* hot_fill copies the file on first access */
 };
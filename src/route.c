@@ -8,8 +8,13 @@
 #include "cwhttpd/route.h"
 #include "cwhttpd/httpd.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 
@@ -24,6 +29,111 @@
 
 #define FILE_CHUNK_LEN (1024)
 
+typedef struct tpl_state_t {
+    cwhttpd_conn_t *conn;
+    cwhttpd_tpl_cb_t cb;
+    void *user;
+    int token_pos;
+    char token[32];
+} tpl_state_t;
+
+static bool send_sink(void *user, const void *buf, size_t len)
+{
+    return cwhttpd_send(user, buf, len) >= 0;
+}
+
+/* Send template text, replacing %token% with the output of the template
+ * callback; tokens may span chunks */
+static bool tpl_sink(void *user, const void *buf, size_t len)
+{
+    tpl_state_t *tpl = user;
+    const char *s = buf;
+    const char *p = s;
+    size_t raw_count = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (tpl->token_pos < 0) {
+            /* we're on ordinary text */
+            if (s[i] == '%') {
+                /* send collected raw data */
+                if (raw_count != 0) {
+                    if (cwhttpd_send(tpl->conn, p, raw_count) < 0) {
+                        return false;
+                    }
+                    raw_count = 0;
+                }
+                /* start collecting token chars */
+                tpl->token_pos = 0;
+            } else {
+                raw_count++;
+            }
+        } else {
+            /* we're in token text */
+            if (s[i] == '%') {
+                if (tpl->token_pos == 0) {
+                    /* this is an escape sequence */
+                    if (cwhttpd_send(tpl->conn, "%", 1) < 0) {
+                        return false;
+                    }
+                } else {
+                    /* this is a token */
+                    tpl->token[tpl->token_pos] = '\0'; /* zero terminate */
+                    tpl->cb(tpl->conn, tpl->token, &tpl->user);
+                }
+
+                /* collect normal characters again */
+                p = &s[i + 1];
+                tpl->token_pos = -1;
+            } else {
+                if (tpl->token_pos < (sizeof(tpl->token) - 1)) {
+                    tpl->token[tpl->token_pos++] = s[i];
+                }
+            }
+        }
+    }
+
+    /* send remainder */
+    if (raw_count != 0 && cwhttpd_send(tpl->conn, p, raw_count) < 0) {
+        return false;
+    }
+    return true;
+}
+
+/* Render a precompiled template from its segments, sending literals straight
+ * from the image when the file can be accessed directly */
+static ssize_t tpl_replay(tpl_state_t *tpl, frogfs_file_t *f,
+        const frogfs_stat_t *st, char *buf, size_t len)
+{
+    frogfs_fs_t *fs = tpl->conn->inst->frogfs;
+    frogfs_segment_t seg;
+    const char *data = NULL;
+
+    if (frogfs_faccess(f, (void **) &data) < 0) {
+        data = NULL;
+    }
+
+    for (int i = 0; frogfs_get_segment(fs, st->obj, i, &seg); i++) {
+        if (seg.type == FROGFS_SEGMENT_TOKEN) {
+            size_t n = seg.len < sizeof(tpl->token) - 1 ? seg.len :
+                    sizeof(tpl->token) - 1;
+            memcpy(tpl->token, seg.token, n);
+            tpl->token[n] = '\0';
+            tpl->cb(tpl->conn, tpl->token, &tpl->user);
+        } else if (data != NULL) {
+            if (cwhttpd_send(tpl->conn, data + seg.offset, seg.len) < 0) {
+                return -1;
+            }
+        } else {
+            if (frogfs_fseek(f, seg.offset, SEEK_SET) < 0 ||
+                    frogfs_fpipe(f, seg.len, buf, len, send_sink,
+                    tpl->conn) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
 static cwhttpd_status_t get_filepath(cwhttpd_conn_t *conn, char *path,
         size_t len, frogfs_stat_t *s, const char *index)
 {
@@ -113,6 +223,156 @@ static cwhttpd_status_t get_filepath(cwhttpd_conn_t *conn, char *path,
     return CWHTTPD_STATUS_NOTFOUND;
 }
 
+static bool etag_match(const char *header, const char *etag)
+{
+    size_t etag_len = strlen(etag);
+
+    while (*header) {
+        while (*header == ' ' || *header == ',') {
+            header++;
+        }
+        /* weak comparison, as required for If-None-Match */
+        if (strncmp(header, "W/", 2) == 0) {
+            header += 2;
+        }
+
+        const char *end = strchr(header, ',');
+        size_t len = end ? end - header : strlen(header);
+        while (len > 0 && header[len - 1] == ' ') {
+            len--;
+        }
+
+        if ((len == 1 && *header == '*') ||
+                (len == etag_len && strncmp(header, etag, len) == 0)) {
+            return true;
+        }
+        header += len;
+        while (*header && *header != ',') {
+            header++;
+        }
+    }
+
+    return false;
+}
+
+/* Parse a single byte range into [start, end). Returns 1 for a valid range,
+ * 0 if the header should be ignored and -1 if the range can't be
+ * satisfied. */
+static int parse_range(const char *header, size_t size, size_t *start,
+        size_t *end)
+{
+    char *p;
+
+    if (strncmp(header, "bytes=", 6) != 0) {
+        return 0;
+    }
+    header += 6;
+
+    /* multiple ranges are not supported, send the whole file instead */
+    if (strchr(header, ',')) {
+        return 0;
+    }
+
+    if (*header == '-') {
+        /* suffix range, the last n bytes */
+        header++;
+        if (*header < '0' || *header > '9') {
+            return 0;
+        }
+        unsigned long n = strtoul(header, &p, 10);
+        if (*p != '\0') {
+            return 0;
+        }
+        if (n == 0 || size == 0) {
+            return -1;
+        }
+        *start = n < size ? size - n : 0;
+        *end = size;
+        return 1;
+    }
+
+    if (*header < '0' || *header > '9') {
+        return 0;
+    }
+    unsigned long first = strtoul(header, &p, 10);
+    if (*p != '-') {
+        return 0;
+    }
+    header = p + 1;
+
+    unsigned long last = ULONG_MAX;
+    if (*header != '\0') {
+        if (*header < '0' || *header > '9') {
+            return 0;
+        }
+        last = strtoul(header, &p, 10);
+        if (*p != '\0' || last < first) {
+            return 0;
+        }
+    }
+
+    if (first >= size) {
+        return -1;
+    }
+    *start = first;
+    *end = last < size - 1 ? last + 1 : size;
+    return 1;
+}
+
+/* Check whether an Accept-Encoding header allows a content coding */
+static bool accepts_encoding(const char *header, const char *coding)
+{
+    size_t coding_len = strlen(coding);
+
+    while (*header) {
+        while (*header == ' ' || *header == ',') {
+            header++;
+        }
+
+        size_t len = strcspn(header, " ;,");
+        size_t end = strcspn(header, ",");
+        if ((len == coding_len && strncasecmp(header, coding, len) == 0) ||
+                (len == 1 && *header == '*')) {
+            /* q=0 means not acceptable */
+            const char *q = header + len;
+            while (q < header + end) {
+                q += strspn(q, " ;");
+                if (strncmp(q, "q=", 2) == 0) {
+                    return strtod(q + 2, NULL) > 0;
+                }
+                q += strcspn(q, ";,");
+            }
+            return true;
+        }
+        header += end;
+    }
+
+    return false;
+}
+
+/* Check the request Accept-Encoding header for gzip */
+static bool accepts_gzip(const char *accept)
+{
+    return accept == NULL || accepts_encoding(accept, "gzip");
+}
+
+/* Return a 404 response for a gzip file the client does not accept */
+static ssize_t send_gzip_only(cwhttpd_conn_t *conn)
+{
+    LOGW(__func__, "client does not accept gzip!");
+    if (cwhttpd_response(conn, 404) < 0 ||
+            cwhttpd_send_header(conn, "Content-Type", "text/plain") < 0) {
+        return -1;
+    }
+    return cwhttpd_send(conn, "only gzip file available", -1);
+}
+
+static const char *encoding_names[] = {
+    [FROGFS_ENCODING_IDENTITY] = "identity",
+    [FROGFS_ENCODING_GZIP] = "gzip",
+    [FROGFS_ENCODING_BROTLI] = "br",
+};
+
 cwhttpd_status_t frogfs_route_get(cwhttpd_conn_t *conn)
 {
     cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
@@ -131,48 +391,166 @@ cwhttpd_status_t frogfs_route_get(cwhttpd_conn_t *conn)
         return status;
     }
 
-    frogfs_file_t *f = frogfs_fopen(conn->inst->frogfs, buf);
+    frogfs_file_storage_t storage;
+    frogfs_file_t *f = NULL;
+    frogfs_meta_t meta;
+    frogfs_get_meta(conn->inst->frogfs, st.obj, &meta);
+
+    const char *mimetype = meta.mime_type;
+    if (mimetype == NULL) {
+        mimetype = cwhttpd_get_mimetype(buf);
+    }
+
+    /* pick the smallest precompressed variant the client accepts */
+    const char *accept = cwhttpd_get_header(conn, "Accept-Encoding");
+    frogfs_variant_t variant, best = { 0 };
+    bool has_variants = false, use_variant = false;
+    int best_index = 0;
+    for (int i = 0; frogfs_get_variant(conn->inst->frogfs, st.obj, i,
+            &variant); i++) {
+        has_variants = true;
+        if (accept && variant.encoding < sizeof(encoding_names) /
+                sizeof(*encoding_names) && accepts_encoding(accept,
+                encoding_names[variant.encoding]) &&
+                (!use_variant || variant.len < best.len)) {
+            best = variant;
+            best_index = i;
+            use_variant = true;
+        }
+    }
+
+    const char *etag = meta.etag;
+    char etag_buf[16];
+    if (use_variant) {
+        snprintf(etag_buf, sizeof(etag_buf), "\"%08x\"",
+                (unsigned) best.crc32);
+        etag = etag_buf;
+    } else if ((st.flags & FROGFS_FLAG_GZIP) && !accepts_gzip(accept)) {
+        TRY(send_gzip_only(conn));
+        goto cleanup;
+    }
+
+    cwhttpd_set_chunked(conn, false);
+
+    /* the client's copy is still current, send headers only; this is
+     * answered before the file is opened, so that revalidations don't count
+     * towards the hot cache */
+    const char *header = cwhttpd_get_header(conn, "If-None-Match");
+    if (etag && header && etag_match(header, etag)) {
+        TRY(cwhttpd_response(conn, 304));
+        TRY(cwhttpd_send_header(conn, "ETag", etag));
+        if (meta.cache_control) {
+            TRY(cwhttpd_send_header(conn, "Cache-Control",
+                    meta.cache_control));
+        }
+        TRY(cwhttpd_chunk_start(conn, 0));
+        TRY(cwhttpd_chunk_end(conn));
+        goto cleanup;
+    }
+
+    f = frogfs_fopen_obj_into(conn->inst->frogfs, st.obj, &storage);
     if (f == NULL) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
 
-    const char *mimetype = cwhttpd_get_mimetype(buf);
+    const char *encoding = NULL;
+    const void *data = NULL;
+    size_t size = st.size;
+    void *raw;
+    if (use_variant) {
+        if (frogfs_faccess_variant(f, best_index, &raw) >= 0) {
+            encoding = encoding_names[best.encoding];
+            data = raw;
+            size = best.len;
+        } else {
+            LOGW(__func__, "variant unavailable, sending the file");
+            use_variant = false;
+            etag = meta.etag;
+        }
+    }
+    if (!use_variant) {
+        if (st.flags & FROGFS_FLAG_GZIP) {
+            if (!accepts_gzip(accept)) {
+                TRY(send_gzip_only(conn));
+                goto cleanup;
+            }
+            encoding = "gzip";
+        }
+        if (frogfs_faccess(f, &raw) >= 0) {
+            /* uncompressed and gzip data is sent straight from the image */
+            data = raw;
+        }
+    }
 
-    bool gzip_encoding = (st.flags & FROGFS_FLAG_GZIP);
-    if (gzip_encoding) {
-        /* Check the request Accept-Encoding header for gzip. Return a 404
-         * response if not present */
-        const char *header = cwhttpd_get_header(conn, "Accept-Encoding");
-        if (header && strstr(header, "gzip") == NULL) {
-            LOGW(__func__, "client does not accept gzip!");
-            frogfs_fclose(f);
-            TRY(cwhttpd_response(conn, 404));
-            TRY(cwhttpd_send_header(conn, "Content-Type", "text/plain"));
-            TRY(cwhttpd_send(conn, "only gzip file available", -1));
-            return CWHTTPD_STATUS_DONE;
+    /* a range of the file, unless If-Range says it has changed */
+    size_t start = 0, end = size;
+    int range = 0;
+    header = cwhttpd_get_header(conn, "Range");
+    if (header) {
+        const char *if_range = cwhttpd_get_header(conn, "If-Range");
+        if (if_range == NULL || (etag && strcmp(if_range, etag) == 0)) {
+            range = parse_range(header, size, &start, &end);
         }
     }
 
-    cwhttpd_set_chunked(conn, false);
-    TRY(cwhttpd_response(conn, 200));
-    if (gzip_encoding) {
-        TRY(cwhttpd_send_header(conn, "Content-Encoding", "gzip"));
+    if (range < 0) {
+        TRY(cwhttpd_response(conn, 416));
+        snprintf(buf, sizeof(buf), "bytes */%u", (unsigned) size);
+        TRY(cwhttpd_send_header(conn, "Content-Range", buf));
+        TRY(cwhttpd_chunk_start(conn, 0));
+        TRY(cwhttpd_chunk_end(conn));
+        goto cleanup;
+    }
+
+    TRY(cwhttpd_response(conn, range ? 206 : 200));
+    TRY(cwhttpd_send_header(conn, "Accept-Ranges", "bytes"));
+    if (encoding) {
+        TRY(cwhttpd_send_header(conn, "Content-Encoding", encoding));
+    }
+    if (has_variants) {
+        TRY(cwhttpd_send_header(conn, "Vary", "Accept-Encoding"));
+    }
+    if (range) {
+        snprintf(buf, sizeof(buf), "bytes %u-%u/%u", (unsigned) start,
+                (unsigned) end - 1, (unsigned) size);
+        TRY(cwhttpd_send_header(conn, "Content-Range", buf));
     }
     if (!(conn->priv.flags & HFL_SEND_CHUNKED)) {
-        snprintf(buf, sizeof(buf), "%d", st.size);
-        TRY(cwhttpd_send_header(conn, "Content-Length", buf));
+        if (!range && !use_variant && meta.content_length) {
+            TRY(cwhttpd_send_header(conn, "Content-Length",
+                    meta.content_length));
+        } else {
+            snprintf(buf, sizeof(buf), "%u", (unsigned) (end - start));
+            TRY(cwhttpd_send_header(conn, "Content-Length", buf));
+        }
     }
     if (mimetype) {
         TRY(cwhttpd_send_header(conn, "Content-Type", mimetype));
     }
-    if (st.flags & FROGFS_FLAG_CACHE) {
+    if (etag) {
+        TRY(cwhttpd_send_header(conn, "ETag", etag));
+    }
+    if (meta.cache_control) {
+        TRY(cwhttpd_send_header(conn, "Cache-Control", meta.cache_control));
+    } else if (st.flags & FROGFS_FLAG_CACHE) {
         TRY(cwhttpd_send_cache_header(conn, NULL));
     }
 
-    ssize_t len;
-    TRY(cwhttpd_chunk_start(conn, st.size));
-    while ((len = frogfs_fread(f, buf, sizeof(buf))) > 0) {
-        TRY(cwhttpd_send(conn, buf, len));
+    size_t remain = end - start;
+    TRY(cwhttpd_chunk_start(conn, remain));
+    if (data != NULL) {
+        if (remain > 0) {
+            TRY(cwhttpd_send(conn, data + start, remain));
+        }
+    } else {
+        if (start > 0) {
+            TRY(frogfs_fseek(f, start, SEEK_SET));
+        }
+        /* only heatshrink data is decoded into buf, the rest is sent from
+         * the image or the decoded block as is */
+        if (remain > 0) {
+            TRY(frogfs_fpipe(f, remain, buf, sizeof(buf), send_sink, conn));
+        }
     }
     TRY(cwhttpd_chunk_end(conn));
 
@@ -193,8 +571,10 @@ cwhttpd_status_t frogfs_route_tpl(cwhttpd_conn_t *conn)
     /* We can use buf here because its not needed until reading data */
     char buf[FILE_CHUNK_LEN];
     frogfs_stat_t st;
-    if (!get_filepath(conn, buf, sizeof(buf), &st, "index.tpl")) {
-        return CWHTTPD_STATUS_NOTFOUND;
+    cwhttpd_status_t status = get_filepath(conn, buf, sizeof(buf), &st,
+            "index.tpl");
+    if (status != CWHTTPD_STATUS_OK) {
+        return status;
     }
 
     if (st.flags & FROGFS_FLAG_GZIP) {
@@ -204,7 +584,9 @@ cwhttpd_status_t frogfs_route_tpl(cwhttpd_conn_t *conn)
 
     const char *mimetype = cwhttpd_get_mimetype(buf);
 
-    frogfs_file_t *f = frogfs_fopen(conn->inst->frogfs, buf);
+    frogfs_file_storage_t storage;
+    frogfs_file_t *f = frogfs_fopen_obj_into(conn->inst->frogfs, st.obj,
+            &storage);
     if (f == NULL) {
         return CWHTTPD_STATUS_NOTFOUND;
     }
@@ -215,63 +597,20 @@ cwhttpd_status_t frogfs_route_tpl(cwhttpd_conn_t *conn)
     }
     cwhttpd_send_cache_header(conn, mimetype);
 
-    cwhttpd_tpl_cb_t cb = conn->route->argv[1];
-    void *user = NULL;
-    size_t len;
-    int token_pos = -1;
-    char token[32];
-    do {
-        len = frogfs_fread(f, buf, FILE_CHUNK_LEN);
-        int raw_count = 0;
-        uint8_t *p = (uint8_t *) buf;
-        if (len > 0) {
-            for (size_t i = 0; i < len; i++) {
-                if (token_pos < 0) {
-                    /* we're on ordinary text */
-                    if (buf[i] == '%') {
-                        /* send collected raw data */
-                        if (raw_count != 0) {
-                            TRY(cwhttpd_send(conn, p, raw_count));
-                            raw_count = 0;
-                        }
-                        /* start collecting token chars */
-                        token_pos = 0;
-                    } else {
-                        raw_count++;
-                    }
-                } else {
-                    /* we're in token text */
-                    if (buf[i] == '%') {
-                        if (token_pos == 0) {
-                            /* this is an escape sequence */
-                            TRY(cwhttpd_send(conn, "%", 1));
-                        } else {
-                            /* this is a token */
-                            token[token_pos] = '\0'; /* zero terminate */
-                            cb(conn, token, &user);
-                        }
-
-                        /* collect normal characters again */
-                        p = (uint8_t *) &buf[i + 1];
-                        token_pos = -1;
-                    } else {
-                        if (token_pos < (sizeof(token) - 1)) {
-                            token[token_pos++] = buf[i];
-                        }
-                    }
-                }
-            }
-        }
-
-        /* send remainder */
-        if (raw_count != 0) {
-            TRY(cwhttpd_send(conn, p, raw_count));
-        }
-    } while (len == FILE_CHUNK_LEN);
+    tpl_state_t tpl = {
+        .conn = conn,
+        .cb = conn->route->argv[1],
+        .token_pos = -1,
+    };
+    if (st.flags & FROGFS_FLAG_TEMPLATE) {
+        TRY(tpl_replay(&tpl, f, &st, buf, sizeof(buf)));
+    } else {
+        TRY(frogfs_fpipe(f, SIZE_MAX, buf, sizeof(buf), tpl_sink, &tpl));
+    }
 
 cleanup:
     /* we're done */
-    cb(conn, NULL, &user);
+    tpl.cb(conn, NULL, &tpl.user);
     frogfs_fclose(f);
     return r;
 }
@@ -308,10 +647,10 @@ cwhttpd_status_t frogfs_route_index(cwhttpd_conn_t *conn)
         return CWHTTPD_STATUS_DONE;
     }
 
-    const char *parent = frogfs_get_path(conn->inst->frogfs, st.index);
-    uint16_t start_index = 0;
-    uint16_t current_index = start_index = st.index;
-    bool files = false;
+    frogfs_dir_t dir;
+    if (!frogfs_opendir_obj(conn->inst->frogfs, st.obj, &dir)) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
 
     cwhttpd_response(conn, 200);
     cwhttpd_send_header(conn, "Content-Type", "text/html");
@@ -330,60 +669,61 @@ cwhttpd_status_t frogfs_route_index(cwhttpd_conn_t *conn)
             "[DIR ]          <a href=\"../\">../</a>\n",
             conn->request.url, conn->request.url));
 
-    do {
-        const char *path = frogfs_get_path(conn->inst->frogfs, current_index);
-        if (path != NULL) {
-            frogfs_stat(conn->inst->frogfs, path, &st);
+    /* directories first, then files */
+    const char *name;
+    while ((name = frogfs_readdir(&dir, &st)) != NULL) {
+        if (st.type == FROGFS_TYPE_DIR) {
+            TRY(cwhttpd_sendf(conn,
+                    "[DIR ]          <a href=\"%H/\">%H/</a>\n", name, name));
         }
+    }
 
-        if (path == NULL && !files) {
-            files = true;
-            current_index = start_index;
-            path = frogfs_get_path(conn->inst->frogfs, current_index);
-            frogfs_stat(conn->inst->frogfs, path, &st);
-        } else if (path == NULL && files) {
-            break;
+    frogfs_seekdir(&dir, 0);
+    while ((name = frogfs_readdir(&dir, &st)) != NULL) {
+        if (st.type == FROGFS_TYPE_FILE) {
+            TRY(cwhttpd_sendf(conn, "[FILE] %-8d <a href=\"%H\">%H</a>\n",
+                    st.size, name, name));
         }
+    }
 
-        if (path == parent) {
-            current_index++;
-            continue;
-        }
+    TRY(cwhttpd_send(conn, "</pre>\n</body>\n</html>\n", -1));
 
-        const char *p = parent;
-        while (*p && *p++ == *path++);
+cleanup:
+    return r;
+}
 
-        if (!files && st.type == FROGFS_TYPE_DIR) {
-            if (path[0] != '/') {
-                files = true;
-                current_index = start_index;
-                continue;
-            }
-            path++;
-            if (strchr(path, '/')) {
-                current_index++;
-                continue;
-            }
-            TRY(cwhttpd_sendf(conn,
-                    "[DIR ]          <a href=\"%H/\">%H/</a>\n", path, path));
-            current_index++;
-        } else if (files && st.type == FROGFS_TYPE_FILE) {
-            if (path[0] != '/') {
-                break;
-            }
-            path++;
-            if (strchr(path, '/')) {
-                current_index++;
-                continue;
-            }
-            TRY(cwhttpd_sendf(conn, "[FILE] %-8d <a href=\"%H\">%H</a>\n",
-                    st.size, path, path));
-            current_index++;
-        }
-        current_index++;
-    } while (true);
+cwhttpd_status_t frogfs_route_stats(cwhttpd_conn_t *conn)
+{
+    cwhttpd_status_t r = CWHTTPD_STATUS_DONE;
 
-    TRY(cwhttpd_send(conn, "</pre>\n</body>\n</html>\n", -1));
+    /* Only process GET requests, otherwise fallthrough */
+    if (conn->request.method != CWHTTPD_METHOD_GET) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    frogfs_stats_t stats;
+    if (!frogfs_get_stats(conn->inst->frogfs, &stats)) {
+        return CWHTTPD_STATUS_NOTFOUND;
+    }
+
+    char buf[FILE_CHUNK_LEN];
+    int len = snprintf(buf, sizeof(buf),
+            "{\"lookups\":%" PRIu32 ",\"lookup_misses\":%" PRIu32
+            ",\"collisions\":%" PRIu32 ",\"opens\":%" PRIu32
+            ",\"open_files\":%" PRIu32 ",\"peak_open_files\":%" PRIu32
+            ",\"decoder_allocs\":%" PRIu32 ",\"decoder_failures\":%" PRIu32
+            ",\"seek_resets\":%" PRIu32 ",\"hot_hits\":%" PRIu32
+            ",\"hot_fills\":%" PRIu32 ",\"raw_bytes\":%" PRIu64
+            ",\"decoded_bytes\":%" PRIu64 "}\n",
+            stats.lookups, stats.lookup_misses, stats.collisions, stats.opens,
+            stats.open_files, stats.peak_open_files, stats.decoder_allocs,
+            stats.decoder_failures, stats.seek_resets, stats.hot_hits,
+            stats.hot_fills, stats.raw_bytes, stats.decoded_bytes);
+
+    TRY(cwhttpd_response(conn, 200));
+    TRY(cwhttpd_send_header(conn, "Content-Type", "application/json"));
+    TRY(cwhttpd_send_header(conn, "Cache-Control", "no-store"));
+    TRY(cwhttpd_send(conn, buf, len));
 
 cleanup:
     return r;
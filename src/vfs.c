@@ -9,7 +9,10 @@
 
 #include <esp_err.h>
 #include <esp_vfs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
+#include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -36,6 +39,8 @@ typedef struct {
         int fd;
         frogfs_file_t *file;
     };
+    int next_free; /* next descriptor in the free list, or -1 */
+    frogfs_file_storage_t storage;
 } vfs_frogfs_file_t;
 
 typedef struct {
@@ -44,14 +49,18 @@ typedef struct {
     char base_path[ESP_VFS_PATH_MAX + 1];
     char overlay_path[ESP_VFS_PATH_MAX + 1];
     size_t max_files;
+    SemaphoreHandle_t lock; /* protects free_head, next_free and overlay */
+    int free_head; /* first free descriptor, or -1 */
+    uint32_t *overlay; /* bitmap of objects that may be in the overlay */
+    size_t overlay_len; /* length of overlay in words */
     vfs_frogfs_file_t files[];
 } vfs_frogfs_t;
 
 typedef struct {
     DIR *overlay_dir;
-    int offset;
+    frogfs_dir_t dir;
+    long offset;
     char path[256];
-    bool done;
     struct dirent e;
 } vfs_frogfs_dir_t;
 
@@ -86,63 +95,189 @@ static void frogfs_get_overlay(vfs_frogfs_t *vfs, char *overlay_path, const char
     }
 }
 
-static ssize_t vfs_frogfs_write(void *ctx, int fd, const void *data,
-                                size_t size)
+/* Claim a free descriptor, or return -1 if all are in use. Once claimed, a
+ * descriptor's state belongs to its owner until it is released. */
+static int file_alloc(vfs_frogfs_t *vfs)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
+    xSemaphoreTake(vfs->lock, portMAX_DELAY);
+    int fd = vfs->free_head;
+    if (fd >= 0) {
+        vfs->free_head = vfs->files[fd].next_free;
+    }
+    xSemaphoreGive(vfs->lock);
+    return fd;
+}
 
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
-        return -1;
+static void file_release(vfs_frogfs_t *vfs, int fd)
+{
+    xSemaphoreTake(vfs->lock, portMAX_DELAY);
+    vfs->files[fd].next_free = vfs->free_head;
+    vfs->free_head = fd;
+    xSemaphoreGive(vfs->lock);
+}
+
+static vfs_frogfs_file_t *file_get(vfs_frogfs_t *vfs, int fd)
+{
+    if (fd < 0 || fd >= vfs->max_files || !vfs->files[fd].used) {
+        errno = EBADF;
+        return NULL;
     }
+    return &vfs->files[fd];
+}
 
-    if (!vfs_frogfs->files[fd].used) {
-        return -1;
+/* Set or clear the overlay bit of an object in the image. A set bit means the
+ * overlay may hold the object's path, a clear bit that it doesn't, so that
+ * lookups of objects that aren't overridden skip the overlay. Paths that are
+ * not in the image are always looked up in the overlay. */
+static void overlay_set(vfs_frogfs_t *vfs, uint16_t index, bool present)
+{
+    xSemaphoreTake(vfs->lock, portMAX_DELAY);
+    if (present) {
+        vfs->overlay[index / 32] |= 1u << (index % 32);
+    } else {
+        vfs->overlay[index / 32] &= ~(1u << (index % 32));
     }
+    xSemaphoreGive(vfs->lock);
+}
 
-    if (vfs_frogfs->files[fd].overlay) {
-        return write(vfs_frogfs->files[fd].fd, data, size);
+static void overlay_mark(vfs_frogfs_t *vfs, const char *path, bool present)
+{
+    frogfs_stat_t s;
+    if (frogfs_stat(vfs->fs, path, &s)) {
+        overlay_set(vfs, s.index, present);
     }
+}
 
-    return -1;
+static bool overlay_test(vfs_frogfs_t *vfs, uint16_t index)
+{
+    xSemaphoreTake(vfs->lock, portMAX_DELAY);
+    bool present = vfs->overlay[index / 32] & (1u << (index % 32));
+    xSemaphoreGive(vfs->lock);
+    return present;
 }
 
-static off_t vfs_frogfs_lseek(void *ctx, int fd, off_t size, int mode)
+/* Return true if the overlay may hold path. If path is in the image, s is
+ * filled in and true is only returned if the path was seen in the overlay. */
+static bool overlay_lookup(vfs_frogfs_t *vfs, const char *path,
+        frogfs_stat_t *s, bool *in_image)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
+    *in_image = frogfs_stat(vfs->fs, path, s);
+    if (!(vfs->flags & VFS_FROGFS_USE_OVERLAY)) {
+        return false;
+    }
+    return !*in_image || overlay_test(vfs, s->index);
+}
 
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
-        return -1;
+/* Directories deeper than this below a scanned directory are not walked;
+ * every object is marked instead, which keeps lookups correct */
+#define OVERLAY_SCAN_DEPTH 8
+
+/* Mark every entry below the overlay directory at path, relative to the
+ * overlay root. The tree is walked iteratively in one buffer holding the
+ * overlay path; each entry's name is written after its directory's length. */
+static void overlay_scan(vfs_frogfs_t *vfs, const char *path)
+{
+    char buf[256];
+    DIR *stack[OVERLAY_SCAN_DEPTH];
+    size_t lens[OVERLAY_SCAN_DEPTH];
+    size_t root_len = strlen(vfs->overlay_path);
+    int depth = 0;
+
+    if (snprintf(buf, sizeof(buf), "%s%s%s", vfs->overlay_path,
+            *path ? "/" : "", path) >= sizeof(buf)) {
+        return;
+    }
+    lens[0] = strlen(buf);
+    stack[0] = opendir(buf);
+    if (stack[0] == NULL) {
+        return;
+    }
+
+    while (depth >= 0) {
+        struct dirent *e = readdir(stack[depth]);
+        if (e == NULL) {
+            closedir(stack[depth]);
+            depth--;
+            continue;
+        }
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t len = lens[depth];
+        if (snprintf(buf + len, sizeof(buf) - len, "/%s", e->d_name) >=
+                sizeof(buf) - len) {
+            continue;
+        }
+        overlay_mark(vfs, buf + root_len + 1, true);
+
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = stat(buf, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) {
+            continue;
+        }
+        if (depth + 1 == OVERLAY_SCAN_DEPTH) {
+            LOGW(__func__, "%s is too deep, marking every object", buf);
+            xSemaphoreTake(vfs->lock, portMAX_DELAY);
+            memset(vfs->overlay, 0xFF, vfs->overlay_len * sizeof(uint32_t));
+            xSemaphoreGive(vfs->lock);
+            continue;
+        }
+        DIR *dir = opendir(buf);
+        if (dir == NULL) {
+            continue;
+        }
+        depth++;
+        stack[depth] = dir;
+        lens[depth] = strlen(buf);
     }
+}
 
-    if (!vfs_frogfs->files[fd].used) {
+static ssize_t vfs_frogfs_write(void *ctx, int fd, const void *data,
+                                size_t size)
+{
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (vfs_frogfs->files[fd].overlay) {
-        return lseek(vfs_frogfs->files[fd].fd, size, mode);
+    if (file->overlay) {
+        return write(file->fd, data, size);
     }
 
-    frogfs_file_t *fp = vfs_frogfs->files[fd].file;
-    return frogfs_fseek(fp, size, mode);
+    return -1;
 }
 
-static ssize_t vfs_frogfs_read(void *ctx, int fd, void *data, size_t size)
+static off_t vfs_frogfs_lseek(void *ctx, int fd, off_t size, int mode)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
-
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (!vfs_frogfs->files[fd].used) {
+    if (file->overlay) {
+        return lseek(file->fd, size, mode);
+    }
+
+    frogfs_file_t *fp = file->file;
+    return frogfs_fseek(fp, size, mode);
+}
+
+static ssize_t vfs_frogfs_read(void *ctx, int fd, void *data, size_t size)
+{
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (vfs_frogfs->files[fd].overlay) {
-        return read(vfs_frogfs->files[fd].fd, data, size);
+    if (file->overlay) {
+        return read(file->fd, data, size);
     }
 
-    frogfs_file_t *fp = vfs_frogfs->files[fd].file;
+    frogfs_file_t *fp = file->file;
     return frogfs_fread(fp, data, size);
 }
 
@@ -150,41 +285,53 @@ static int vfs_frogfs_open(void *ctx, const char *path, int flags, int mode)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    int fd;
-    for (fd = 0; fd < vfs_frogfs->max_files; fd++) {
-        if (!vfs_frogfs->files[fd].used) {
-            break;
-        }
-    }
-
-    if (fd >= vfs_frogfs->max_files) {
+    int fd = file_alloc(vfs_frogfs);
+    if (fd < 0) {
+        errno = ENFILE;
         return -1;
     }
+    vfs_frogfs_file_t *file = &vfs_frogfs->files[fd];
 
-    if (vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    frogfs_stat_t s;
+    bool in_image;
+    bool in_overlay = overlay_lookup(vfs_frogfs, path, &s, &in_image);
+    bool writing = flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC);
+    if (in_overlay || ((vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) &&
+            writing)) {
         char overlay_path[256];
 
         frogfs_get_overlay(vfs_frogfs, overlay_path, path,
                            sizeof(overlay_path));
-        vfs_frogfs->files[fd].fd = open(overlay_path, flags, mode);
-        if (vfs_frogfs->files[fd].fd >= 0) {
-            vfs_frogfs->files[fd].used = true;
-            vfs_frogfs->files[fd].overlay = true;
+        file->fd = open(overlay_path, flags, mode);
+        if (file->fd >= 0) {
+            if (writing && in_image) {
+                overlay_set(vfs_frogfs, s.index, true);
+            }
+            file->overlay = true;
+            file->used = true;
             return fd;
         }
     }
 
-    if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) {
+    if (writing) {
+        file_release(vfs_frogfs, fd);
         return -1;
     }
 
-    vfs_frogfs->files[fd].file = frogfs_fopen(vfs_frogfs->fs, path);
-    if (vfs_frogfs->files[fd].file != NULL) {
-        vfs_frogfs->files[fd].used = true;
-        vfs_frogfs->files[fd].overlay = false;
+    if (in_image && s.type == FROGFS_TYPE_FILE) {
+        file->file = frogfs_fopen_obj_into(vfs_frogfs->fs, s.obj,
+                &file->storage);
+    } else {
+        file->file = NULL;
+    }
+    if (file->file != NULL) {
+        file->overlay = false;
+        file->used = true;
         return fd;
     }
 
+    file_release(vfs_frogfs, fd);
+    errno = ENOENT;
     return -1;
 }
 
@@ -192,42 +339,35 @@ static int vfs_frogfs_close(void *ctx, int fd)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
+    vfs_frogfs_file_t *file = file_get(vfs_frogfs, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (!vfs_frogfs->files[fd].used) {
-        return -1;
-    }
-
-    vfs_frogfs->files[fd].used = false;
-
-    if (vfs_frogfs->files[fd].overlay) {
-        return close(vfs_frogfs->files[fd].fd);
+    /* the descriptor is only reused once it has been released */
+    int ret = 0;
+    file->used = false;
+    if (file->overlay) {
+        ret = close(file->fd);
+    } else {
+        frogfs_fclose(file->file);
     }
-
-    frogfs_file_t *fp = vfs_frogfs->files[fd].file;
-    frogfs_fclose(fp);
-    return 0;
+    file_release(vfs_frogfs, fd);
+    return ret;
 }
 
 static int vfs_frogfs_fstat(void *ctx, int fd, struct stat *st)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
-
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (!vfs_frogfs->files[fd].used) {
-        return -1;
-    }
-
-    if (vfs_frogfs->files[fd].overlay) {
-        return fstat(vfs_frogfs->files[fd].fd, st);
+    if (file->overlay) {
+        return fstat(file->fd, st);
     }
 
-    frogfs_file_t *fp = vfs_frogfs->files[fd].file;
+    frogfs_file_t *fp = file->file;
     memset(st, 0, sizeof(struct stat));
     st->st_mode = S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH |
             S_IFREG;
@@ -241,7 +381,9 @@ static int vfs_frogfs_stat(void *ctx, const char *path, struct stat *st)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    if (vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    frogfs_stat_t s;
+    bool in_image;
+    if (overlay_lookup(vfs_frogfs, path, &s, &in_image)) {
         char overlay_path[256];
         frogfs_get_overlay(vfs_frogfs, overlay_path, path,
                            sizeof(overlay_path));
@@ -252,8 +394,7 @@ static int vfs_frogfs_stat(void *ctx, const char *path, struct stat *st)
         }
     }
 
-    frogfs_stat_t s;
-    if (!frogfs_stat(vfs_frogfs->fs, path, &s)) {
+    if (!in_image) {
         return -1;
     }
 
@@ -270,7 +411,7 @@ static int vfs_frogfs_link(void *ctx, const char *n1, const char *n2)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    if (!vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    if (!(vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY)) {
         return -1;
     }
 
@@ -278,28 +419,36 @@ static int vfs_frogfs_link(void *ctx, const char *n1, const char *n2)
     frogfs_get_overlay(vfs_frogfs, overlay_n1, n1, sizeof(overlay_n1));
     frogfs_get_overlay(vfs_frogfs, overlay_n2, n2, sizeof(overlay_n2));
 
-    return link(overlay_n1, overlay_n2);
+    int ret = link(overlay_n1, overlay_n2);
+    if (ret == 0) {
+        overlay_mark(vfs_frogfs, n2, true);
+    }
+    return ret;
 }
 
 static int vfs_frogfs_unlink(void *ctx, const char *path)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    if (!vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    if (!(vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY)) {
         return -1;
     }
 
     char overlay_path[256];
     frogfs_get_overlay(vfs_frogfs, overlay_path, path, sizeof(overlay_path));
 
-    return unlink(overlay_path);
+    int ret = unlink(overlay_path);
+    if (ret == 0) {
+        overlay_mark(vfs_frogfs, path, false);
+    }
+    return ret;
 }
 
 static int vfs_frogfs_rename(void *ctx, const char *src, const char *dst)
 {
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
 
-    if (!vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    if (!(vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY)) {
         return -1;
     }
 
@@ -309,8 +458,12 @@ static int vfs_frogfs_rename(void *ctx, const char *src, const char *dst)
 
     struct stat st;
     frogfs_stat_t s;
-    if (stat(overlay_src, &st) < 0 && frogfs_stat(vfs_frogfs->fs, src, &s)) {
-        frogfs_file_t *src_file = frogfs_fopen(vfs_frogfs->fs, src);
+    bool in_image;
+    bool in_overlay = overlay_lookup(vfs_frogfs, src, &s, &in_image);
+    if (in_image && (!in_overlay || stat(overlay_src, &st) < 0)) {
+        frogfs_file_storage_t storage;
+        frogfs_file_t *src_file = frogfs_fopen_obj_into(vfs_frogfs->fs, s.obj,
+                &storage);
         if (!src_file) {
             return -1;
         }
@@ -321,6 +474,7 @@ static int vfs_frogfs_rename(void *ctx, const char *src, const char *dst)
             frogfs_fclose(src_file);
             return -1;
         }
+        overlay_mark(vfs_frogfs, dst, true);
 
         int chunk;
         char buf[512];
@@ -332,7 +486,16 @@ static int vfs_frogfs_rename(void *ctx, const char *src, const char *dst)
         return 0;
     }
 
-    return rename(overlay_src, overlay_dst);
+    int ret = rename(overlay_src, overlay_dst);
+    if (ret == 0) {
+        overlay_mark(vfs_frogfs, src, false);
+        overlay_mark(vfs_frogfs, dst, true);
+        if (stat(overlay_dst, &st) == 0 && S_ISDIR(st.st_mode)) {
+            /* entries below a moved directory move with it */
+            overlay_scan(vfs_frogfs, dst);
+        }
+    }
+    return ret;
 }
 
 static DIR* vfs_frogfs_opendir(void *ctx, const char *name)
@@ -347,13 +510,11 @@ static DIR* vfs_frogfs_opendir(void *ctx, const char *name)
     strncpy(dir->path, name, sizeof(dir->path) - 1);
     dir->path[sizeof(dir->path) - 1] = '\0';
 
-    frogfs_stat_t s;
-    if (!frogfs_stat(vfs_frogfs->fs, dir->path, &s) ||
-            s.type != FROGFS_TYPE_DIR) {
+    if (!frogfs_opendir(vfs_frogfs->fs, dir->path, &dir->dir)) {
         free(dir);
+        errno = ENOENT;
         return NULL;
     }
-    dir->offset = s.index + 1;
 
     return (DIR *) dir;
 }
@@ -378,46 +539,26 @@ static int vfs_frogfs_readdir_r(void *ctx, DIR *pdir, struct dirent *entry,
     vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
     vfs_frogfs_dir_t *dir = (vfs_frogfs_dir_t *) pdir;
 
-    if (dir->done) {
-        *out_dirent = NULL;
-        return 0;
-    }
-
-    while (dir->offset < vfs_frogfs->fs->header->num_objects) {
-        const char *path = frogfs_get_path(vfs_frogfs->fs, dir->offset);
-
-        if (vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) {
+    const char *name;
+    frogfs_stat_t s;
+    while ((name = frogfs_readdir(&dir->dir, &s)) != NULL) {
+        if ((vfs_frogfs->flags & VFS_FROGFS_USE_OVERLAY) &&
+                overlay_test(vfs_frogfs, s.index)) {
+            /* entries present in the overlay are listed from there */
             char overlay_path[256];
-            frogfs_get_overlay(vfs_frogfs, overlay_path, path,
-                               sizeof(overlay_path));
+            frogfs_get_overlay(vfs_frogfs, overlay_path,
+                    frogfs_get_path(vfs_frogfs->fs, s.index),
+                    sizeof(overlay_path));
 
             struct stat st;
-            if (stat(path, &st)) {
-                dir->offset++;
+            if (stat(overlay_path, &st) == 0) {
                 continue;
             }
         }
 
-        frogfs_stat_t s;
-        frogfs_stat(vfs_frogfs->fs, path, &s);
-
-        const char *p = dir->path;
-        while (*p && *p++ == *path++);
-
-        if (path[0] != '/') {
-            dir->done = true;
-            *out_dirent = NULL;
-            return 0;
-        }
-        path++;
-        if (strchr(path, '/')) {
-            dir->offset++;
-            continue;
-        }
-
         entry->d_ino = 0;
         entry->d_type = (s.type == FROGFS_TYPE_DIR) ? DT_DIR : DT_REG;
-        strncpy(entry->d_name, path, sizeof(entry->d_name) - 1);
+        strncpy(entry->d_name, name, sizeof(entry->d_name) - 1);
         entry->d_name[sizeof(entry->d_name) - 1] = '\0';
         dir->offset++;
         *out_dirent = entry;
@@ -437,10 +578,10 @@ static int vfs_frogfs_readdir_r(void *ctx, DIR *pdir, struct dirent *entry,
         }
 
         int ret = readdir_r(dir->overlay_dir, entry, out_dirent);
-        if (ret != 0 || *out_dirent == NULL) {
+        if (ret == 0 && *out_dirent != NULL) {
             dir->offset++;
-            return ret;
         }
+        return ret;
     }
 
     *out_dirent = NULL;
@@ -455,24 +596,20 @@ static long vfs_frogfs_telldir(void *ctx, DIR *pdir)
 
 static void vfs_frogfs_seekdir(void *ctx, DIR *pdir, long offset)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
     vfs_frogfs_dir_t *dir = (vfs_frogfs_dir_t *) pdir;
 
     if (offset < dir->offset) {
         if (dir->overlay_dir) {
             closedir(dir->overlay_dir);
+            dir->overlay_dir = NULL;
         }
+        frogfs_seekdir(&dir->dir, 0);
         dir->offset = 0;
     }
-    if (offset < vfs_frogfs->fs->header->num_objects) {
-        dir->offset = offset;
-    } else {
-        dir->offset = vfs_frogfs->fs->header->num_objects;
-    }
     while (dir->offset < offset) {
         struct dirent *tmp;
-        vfs_frogfs_readdir_r(ctx, pdir, &dir->e, &tmp);
-        if (tmp == NULL) {
+        if (vfs_frogfs_readdir_r(ctx, pdir, &dir->e, &tmp) != 0 ||
+                tmp == NULL) {
             break;
         }
     }
@@ -498,7 +635,11 @@ static int vfs_frogfs_mkdir(void *ctx, const char *name, mode_t mode)
         frogfs_get_overlay(vfs_frogfs, overlay_path, name,
                            sizeof(overlay_path));
 
-        return mkdir(overlay_path, mode);
+        int ret = mkdir(overlay_path, mode);
+        if (ret == 0) {
+            overlay_mark(vfs_frogfs, name, true);
+        }
+        return ret;
     }
 
     return -1;
@@ -513,7 +654,11 @@ static int vfs_frogfs_rmdir(void *ctx, const char *name)
         frogfs_get_overlay(vfs_frogfs, overlay_path, name,
                            sizeof(overlay_path));
 
-        return rmdir(overlay_path);
+        int ret = rmdir(overlay_path);
+        if (ret == 0) {
+            overlay_mark(vfs_frogfs, name, false);
+        }
+        return ret;
     }
 
     return -1;
@@ -522,18 +667,13 @@ static int vfs_frogfs_rmdir(void *ctx, const char *name)
 
 static int vfs_frogfs_fcntl(void *ctx, int fd, int cmd, int arg)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
-
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
-        return -1;
-    }
-
-    if (!vfs_frogfs->files[fd].used) {
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (vfs_frogfs->files[fd].overlay) {
-        return fcntl(vfs_frogfs->files[fd].fd, cmd, arg);
+    if (file->overlay) {
+        return fcntl(file->fd, cmd, arg);
     }
 
     return -1;
@@ -541,19 +681,14 @@ static int vfs_frogfs_fcntl(void *ctx, int fd, int cmd, int arg)
 
 static int vfs_frogfs_ioctl(void *ctx, int fd, int cmd, va_list args)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
-
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (!vfs_frogfs->files[fd].used) {
-        return -1;
-    }
-
-    if (vfs_frogfs->files[fd].overlay) {
+    if (file->overlay) {
         char *argp = va_arg(args, char *);
-        return ioctl(vfs_frogfs->files[fd].fd, cmd, argp);
+        return ioctl(file->fd, cmd, argp);
     }
 
     return -1;
@@ -561,18 +696,13 @@ static int vfs_frogfs_ioctl(void *ctx, int fd, int cmd, va_list args)
 
 static int vfs_frogfs_fsync(void *ctx, int fd)
 {
-    vfs_frogfs_t *vfs_frogfs = (vfs_frogfs_t *) ctx;
-
-    if (fd < 0 || fd >= vfs_frogfs->max_files) {
-        return -1;
-    }
-
-    if (!vfs_frogfs->files[fd].used) {
+    vfs_frogfs_file_t *file = file_get((vfs_frogfs_t *) ctx, fd);
+    if (file == NULL) {
         return -1;
     }
 
-    if (vfs_frogfs->files[fd].overlay) {
-        return fsync(vfs_frogfs->files[fd].fd);
+    if (file->overlay) {
+        return fsync(file->fd);
     }
 
     return -1;
@@ -614,14 +744,25 @@ esp_err_t esp_vfs_frogfs_register(const esp_vfs_frogfs_conf_t *conf)
     }
 
     vfs_frogfs_t *vfs_frogfs = calloc(1, sizeof(vfs_frogfs_t) +
-            (sizeof(vfs_frogfs_file_t *) * conf->max_files));
+            (sizeof(vfs_frogfs_file_t) * conf->max_files));
     if (vfs_frogfs == NULL) {
         LOGE(__func__, "vfs_frogfs could not be alloc'd");
         return ESP_ERR_NO_MEM;
     }
 
+    vfs_frogfs->lock = xSemaphoreCreateMutex();
+    if (vfs_frogfs->lock == NULL) {
+        LOGE(__func__, "xSemaphoreCreateMutex failed");
+        free(vfs_frogfs);
+        return ESP_ERR_NO_MEM;
+    }
+
     vfs_frogfs->fs = conf->fs;
     vfs_frogfs->max_files = conf->max_files;
+    vfs_frogfs->free_head = conf->max_files ? 0 : -1;
+    for (int i = 0; i < conf->max_files; i++) {
+        vfs_frogfs->files[i].next_free = i + 1 < conf->max_files ? i + 1 : -1;
+    }
     strncpy(vfs_frogfs->base_path, conf->base_path,
             sizeof(vfs_frogfs->base_path) - 1);
     vfs_frogfs->base_path[sizeof(vfs_frogfs->base_path) - 1] = '\0';
@@ -630,10 +771,28 @@ esp_err_t esp_vfs_frogfs_register(const esp_vfs_frogfs_conf_t *conf)
         strncpy(vfs_frogfs->overlay_path, conf->overlay_path,
                 sizeof(vfs_frogfs->overlay_path));
         vfs_frogfs->overlay_path[sizeof(vfs_frogfs->overlay_path) - 1] = '\0';
+
+        /* a delta image numbers its objects after those of its base */
+        uint32_t num_objects = conf->fs->header->num_objects;
+        if (conf->fs->base != NULL) {
+            num_objects += conf->fs->base->header->num_objects;
+        }
+        vfs_frogfs->overlay_len = num_objects / 32 + 1;
+        vfs_frogfs->overlay = calloc(vfs_frogfs->overlay_len,
+                sizeof(uint32_t));
+        if (vfs_frogfs->overlay == NULL) {
+            LOGE(__func__, "overlay index could not be alloc'd");
+            vSemaphoreDelete(vfs_frogfs->lock);
+            free(vfs_frogfs);
+            return ESP_ERR_NO_MEM;
+        }
+        overlay_scan(vfs_frogfs, "");
     }
 
     esp_err_t err = esp_vfs_register(vfs_frogfs->base_path, &vfs, vfs_frogfs);
     if (err != ESP_OK) {
+        vSemaphoreDelete(vfs_frogfs->lock);
+        free(vfs_frogfs->overlay);
         free(vfs_frogfs);
         return err;
     }
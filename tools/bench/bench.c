@@ -0,0 +1,434 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/**
+ * Host benchmark for the hot paths of the frogfs runtime: path lookups,
+ * directory listing, sequential reads and random access seeks, measured on
+ * images generated by mkbench.py. The bytes read are checked against the
+ * source tree the image was built from when it is given.
+ */
+
+#include "frogfs/frogfs.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define NUM_COMPRESSIONS (FROGFS_COMPRESSION_LZ4 + 1)
+#define SEEK_READ_LEN (16)
+
+static const char *compression_names[NUM_COMPRESSIONS] = {
+    [FROGFS_COMPRESSION_NONE] = "none",
+    [FROGFS_COMPRESSION_HEATSHRINK] = "heatshrink",
+    [FROGFS_COMPRESSION_LZ4] = "lz4",
+};
+
+typedef struct bench_file_t {
+    char *path;
+    frogfs_stat_t st;
+    char *data; /* source contents, NULL without a source tree */
+} bench_file_t;
+
+typedef struct bench_t {
+    frogfs_fs_t *fs;
+    const char *src_dir;
+    bench_file_t *files;
+    size_t num_files;
+    size_t num_entries;
+    int iterations;
+    int seeks;
+    size_t buf_lens[8];
+    int num_buf_lens;
+} bench_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool read_image(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    return pread(*(int *) ctx, buf, len, offset) == (ssize_t) len;
+}
+
+/* Load the source of a file from the source tree, exiting if it does not
+ * match the size in the image. */
+static char *read_source(bench_t *b, const char *path, size_t size)
+{
+    char src_path[512];
+    snprintf(src_path, sizeof(src_path), "%s/%s", b->src_dir, path);
+
+    FILE *fp = fopen(src_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "open %s failed\n", src_path);
+        exit(EXIT_FAILURE);
+    }
+    char *data = malloc(size + 1);
+    if (data == NULL) {
+        fputs("malloc failed\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(data, 1, size + 1, fp) != size) {
+        fprintf(stderr, "%s does not match the image\n", src_path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return data;
+}
+
+/* Recursively list a directory, collecting the files when collect is set, and
+ * return the number of entries seen. */
+static size_t walk(bench_t *b, const char *path, bool collect)
+{
+    frogfs_dir_t dir;
+    frogfs_stat_t st;
+    const char *name;
+    size_t entries = 0;
+
+    if (!frogfs_opendir(b->fs, path, &dir)) {
+        return 0;
+    }
+
+    while ((name = frogfs_readdir(&dir, &st)) != NULL) {
+        char child[256];
+        snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "",
+                name);
+        entries++;
+        if (st.type == FROGFS_TYPE_DIR) {
+            entries += walk(b, child, collect);
+        } else if (collect) {
+            bench_file_t *files = realloc(b->files,
+                    (b->num_files + 1) * sizeof(bench_file_t));
+            if (files == NULL) {
+                fputs("realloc failed\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+            b->files = files;
+            b->files[b->num_files].path = strdup(child);
+            b->files[b->num_files].st = st;
+            b->files[b->num_files].data = b->src_dir ?
+                    read_source(b, child, st.size) : NULL;
+            b->num_files++;
+        }
+    }
+    return entries;
+}
+
+static void bench_readdir(bench_t *b)
+{
+    double start = now();
+    for (int i = 0; i < b->iterations; i++) {
+        walk(b, "", false);
+    }
+    double elapsed = now() - start;
+
+    printf("readdir    %8zu entries %12.1f us/listing\n", b->num_entries,
+            elapsed * 1e6 / b->iterations);
+}
+
+static void bench_lookup(bench_t *b)
+{
+    frogfs_stat_t st;
+    size_t found = 0;
+    char miss[260];
+
+    double start = now();
+    for (int i = 0; i < b->iterations; i++) {
+        for (size_t j = 0; j < b->num_files; j++) {
+            found += frogfs_stat(b->fs, b->files[j].path, &st);
+        }
+    }
+    double elapsed = now() - start;
+    double lookups = (double) b->iterations * b->num_files;
+
+    if (found != lookups) {
+        fputs("lookup failed\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    printf("lookup hit %8zu paths   %12.0f lookups/s\n", b->num_files,
+            lookups / elapsed);
+
+    start = now();
+    for (int i = 0; i < b->iterations; i++) {
+        for (size_t j = 0; j < b->num_files; j++) {
+            snprintf(miss, sizeof(miss), "%s~", b->files[j].path);
+            found += frogfs_stat(b->fs, miss, &st);
+        }
+    }
+    elapsed = now() - start;
+    printf("lookup miss%8zu paths   %12.0f lookups/s\n", b->num_files,
+            lookups / elapsed);
+}
+
+/* Read every file of a compression type through, checking the bytes read
+ * against the source tree when verify is set, and return the bytes read. */
+static uint64_t read_files(bench_t *b, frogfs_compression_type_t comp,
+        char *buf, size_t buf_len, bool verify)
+{
+    uint64_t bytes = 0;
+
+    for (size_t j = 0; j < b->num_files; j++) {
+        bench_file_t *file = &b->files[j];
+        if (file->st.compression != comp) {
+            continue;
+        }
+        frogfs_file_t *f = frogfs_fopen_obj(b->fs, file->st.obj);
+        if (f == NULL) {
+            fprintf(stderr, "open %s failed\n", file->path);
+            exit(EXIT_FAILURE);
+        }
+        size_t pos = 0;
+        ssize_t len;
+        while ((len = frogfs_fread(f, buf, buf_len)) > 0) {
+            if (verify && (pos + len > file->st.size ||
+                    memcmp(buf, file->data + pos, len) != 0)) {
+                break;
+            }
+            pos += len;
+        }
+        if (len < 0 || pos != file->st.size) {
+            fprintf(stderr, "read %s failed at %zu\n", file->path, pos);
+            exit(EXIT_FAILURE);
+        }
+        bytes += pos;
+        frogfs_fclose(f);
+    }
+    return bytes;
+}
+
+static void bench_fread(bench_t *b, frogfs_compression_type_t comp,
+        size_t buf_len)
+{
+    char *buf = malloc(buf_len);
+    uint64_t bytes = 0;
+
+    if (buf == NULL) {
+        fputs("malloc failed\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* check the contents in an untimed pass, the timed ones check lengths */
+    if (b->src_dir) {
+        read_files(b, comp, buf, buf_len, true);
+    }
+
+    double start = now();
+    for (int i = 0; i < b->iterations; i++) {
+        bytes += read_files(b, comp, buf, buf_len, false);
+    }
+    double elapsed = now() - start;
+
+    printf("fread      %-10s %6zu B   %10.2f MB/s\n",
+            compression_names[comp], buf_len, bytes / elapsed / 1e6);
+    free(buf);
+}
+
+static void bench_fseek(bench_t *b, frogfs_compression_type_t comp)
+{
+    char buf[SEEK_READ_LEN];
+    uint64_t seeks = 0;
+    unsigned int seed = 1;
+
+    double start = now();
+    for (size_t j = 0; j < b->num_files; j++) {
+        bench_file_t *file = &b->files[j];
+        if (file->st.compression != comp || file->st.size == 0) {
+            continue;
+        }
+        frogfs_file_t *f = frogfs_fopen_obj(b->fs, file->st.obj);
+        if (f == NULL) {
+            fprintf(stderr, "open %s failed\n", file->path);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < b->seeks; i++) {
+            long offset = rand_r(&seed) % file->st.size;
+            size_t expected = file->st.size - offset;
+            if (expected > sizeof(buf)) {
+                expected = sizeof(buf);
+            }
+            if (frogfs_fseek(f, offset, SEEK_SET) != offset ||
+                    frogfs_fread(f, buf, sizeof(buf)) != (ssize_t) expected ||
+                    (file->data != NULL && memcmp(buf, file->data + offset,
+                    expected) != 0)) {
+                fprintf(stderr, "seek %s to %ld failed\n", file->path,
+                        offset);
+                exit(EXIT_FAILURE);
+            }
+            seeks++;
+        }
+        frogfs_fclose(f);
+    }
+    double elapsed = now() - start;
+
+    /* only empty files use this compression */
+    if (seeks == 0) {
+        return;
+    }
+    printf("fseek      %-10s          %10.2f us/seek\n",
+            compression_names[comp], elapsed * 1e6 / seeks);
+}
+
+static int bench_image(bench_t *b, const char *image, int pages)
+{
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed\n", image);
+        return -1;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        fputs("fstat failed\n", stderr);
+        close(fd);
+        return -1;
+    }
+
+    frogfs_config_t config = { 0 };
+    void *addr = NULL;
+    if (pages) {
+        config.read = read_image;
+        config.read_ctx = &fd;
+        config.cache_pages = pages;
+    } else {
+        addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fputs("mmap failed\n", stderr);
+            close(fd);
+            return -1;
+        }
+        config.addr = addr;
+    }
+
+    double start = now();
+    b->fs = frogfs_init(&config);
+    double elapsed = now() - start;
+    if (b->fs == NULL) {
+        fputs("frogfs_init failed\n", stderr);
+        if (addr) {
+            munmap(addr, sb.st_size);
+        }
+        close(fd);
+        return -1;
+    }
+
+    b->files = NULL;
+    b->num_files = 0;
+    b->num_entries = walk(b, "", true);
+
+    printf("%s: %lld bytes, %zu files, init %.1f us\n", image,
+            (long long) sb.st_size, b->num_files, elapsed * 1e6);
+    bench_readdir(b);
+    bench_lookup(b);
+    for (int comp = 0; comp < NUM_COMPRESSIONS; comp++) {
+        size_t j;
+        for (j = 0; j < b->num_files; j++) {
+            if (b->files[j].st.compression == comp) {
+                break;
+            }
+        }
+        if (j == b->num_files) {
+            continue;
+        }
+        for (int i = 0; i < b->num_buf_lens; i++) {
+            bench_fread(b, comp, b->buf_lens[i]);
+        }
+        bench_fseek(b, comp);
+    }
+
+    for (size_t j = 0; j < b->num_files; j++) {
+        free(b->files[j].path);
+        free(b->files[j].data);
+    }
+    free(b->files);
+    frogfs_deinit(b->fs);
+    if (addr) {
+        munmap(addr, sb.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n ITERATIONS] [-s SEEKS] [-b LEN[,LEN...]] "
+            "[-p PAGES] [-d DIR] IMAGE...\n"
+            "  -n  passes over all files per benchmark, default 10\n"
+            "  -s  random seeks per file, default 16\n"
+            "  -b  fread buffer lengths, default 64,512,4096\n"
+            "  -p  mount with a read callback and a cache of PAGES pages "
+            "instead of mmap\n"
+            "  -d  check the bytes read against the source tree in DIR\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t b = {
+        .iterations = 10,
+        .seeks = 16,
+        .buf_lens = { 64, 512, 4096 },
+        .num_buf_lens = 3,
+    };
+    int pages = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:b:p:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            b.iterations = atoi(optarg);
+            break;
+        case 's':
+            b.seeks = atoi(optarg);
+            break;
+        case 'b':
+            b.num_buf_lens = 0;
+            for (char *s = strtok(optarg, ","); s != NULL &&
+                    b.num_buf_lens < 8; s = strtok(NULL, ",")) {
+                b.buf_lens[b.num_buf_lens++] = strtoul(s, NULL, 0);
+            }
+            break;
+        case 'p':
+            pages = atoi(optarg);
+            break;
+        case 'd':
+            b.src_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || b.iterations < 1 || b.seeks < 1 ||
+            b.num_buf_lens < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < b.num_buf_lens; i++) {
+        if (b.buf_lens[i] == 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (bench_image(&b, argv[i], pages) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (i + 1 < argc) {
+            putchar('\n');
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+from argparse import ArgumentParser
+
+script_dir = os.path.dirname(os.path.realpath(__file__))
+tools_dir = os.path.join(script_dir, '..')
+
+words = ('frog', 'pond', 'lily', 'leap', 'green', 'croak', 'tadpole',
+        'water', 'fly', 'swamp', 'reed', 'moss', 'stone', 'ripple', 'night',
+        'song', 'the', 'a', 'of', 'and', 'to', 'in', 'is', 'on', 'with')
+
+def make_text(rng, size):
+    out = []
+    length = 0
+    while length < size:
+        word = rng.choice(words)
+        if rng.random() < 0.05:
+            word = '%s%d' % (word, rng.randrange(1 << 16))
+        out.append(word)
+        length += len(word) + 1
+    return ' '.join(out)[:size].encode()
+
+def make_tree(src_dir, rng):
+    for i in range(args.objects):
+        path = os.path.join(src_dir, 'd%d' % (i // args.fanout))
+        os.makedirs(path, exist_ok=True)
+        size = rng.randint(args.size // 2, args.size * 3 // 2)
+        with open(os.path.join(path, 'f%d.txt' % i), 'wb') as f:
+            f.write(make_text(rng, size))
+
+def make_config(path):
+    compressor = args.compression
+    config = {
+        'filters': {
+            '*.txt': compressor,
+        },
+        'compressors': {
+            'heatshrink': {
+                'window_sz2': 11,
+                'lookahead_sz2': 4,
+                'block_sz2': args.block_sz2,
+            },
+            'lz4': {
+                'block_sz2': args.block_sz2,
+                'level': 9,
+            },
+        },
+    }
+    with open(path, 'w') as f:
+        json.dump(config, f)
+
+def main():
+    global args
+
+    parser = ArgumentParser(
+            description='generate a synthetic frogfs image for benchmarking')
+    parser.add_argument('dst_bin', metavar='DST', help='destination binary')
+    parser.add_argument('--objects', type=int, default=1000,
+            help='number of files')
+    parser.add_argument('--fanout', type=int, default=32,
+            help='number of files per directory')
+    parser.add_argument('--size', type=int, default=4096,
+            help='average file size, sizes vary by +/- 50%%')
+    parser.add_argument('--compression', default='heatshrink',
+            choices=('uncompressed', 'heatshrink', 'lz4'),
+            help='compressor for all files')
+    parser.add_argument('--block-sz2', type=int, default=12,
+            help='seek table block size of compressed files, 0 for none')
+    parser.add_argument('--seed', type=int, default=0,
+            help='random seed for file contents')
+    parser.add_argument('--no-mph', action='store_true',
+            help='do not build a minimal perfect hash index')
+    parser.add_argument('--src-dir', metavar='DIR',
+            help='keep the generated files in DIR, which must not exist yet, '
+            'for frogfs_bench -d')
+    args = parser.parse_args()
+
+    if args.objects < 1 or args.fanout < 1 or args.size < 2:
+        print('objects, fanout and size must be positive', file=sys.stderr)
+        sys.exit(1)
+
+    if args.src_dir and os.path.exists(args.src_dir):
+        print('%s already exists' % args.src_dir, file=sys.stderr)
+        sys.exit(1)
+
+    work_dir = tempfile.mkdtemp(prefix='frogfs_bench')
+    try:
+        src_dir = args.src_dir or os.path.join(work_dir, 'src')
+        dst_dir = os.path.join(work_dir, 'dst')
+        config = os.path.join(work_dir, 'config.json')
+        make_tree(src_dir, random.Random(args.seed))
+        make_config(config)
+
+        subprocess.run([sys.executable,
+                os.path.join(tools_dir, 'preprocess.py'), '--config', config,
+                src_dir, dst_dir], check=True, stdout=subprocess.DEVNULL)
+        mkfrogfs = [sys.executable, os.path.join(tools_dir, 'mkfrogfs.py'),
+                '--no-cache']
+        if args.no_mph:
+            mkfrogfs.append('--no-mph')
+        subprocess.run(mkfrogfs + [dst_dir, args.dst_bin], check=True,
+                stdout=subprocess.DEVNULL)
+    except subprocess.CalledProcessError as e:
+        print('%s failed' % os.path.basename(e.cmd[1]), file=sys.stderr)
+        sys.exit(1)
+    finally:
+        shutil.rmtree(work_dir)
+
+if __name__ == '__main__':
+    main()
@@ -7,6 +7,8 @@ def main():
     parser = ArgumentParser()
     parser.add_argument('src_bin', metavar='SRC', help='source binary data')
     parser.add_argument('dst_out', metavar='DST', help='destination c source')
+    parser.add_argument('--align', type=int, default=4,
+            help='alignment of the array in bytes')
     args = parser.parse_args()
 
     with open(args.src_bin, 'rb') as f:
@@ -40,7 +42,7 @@ f'''#include <stddef.h>
 #include <stdint.h>
 
 const size_t {varname}_len = {data_len};
-const __attribute__((aligned(4))) uint8_t {varname}[] = {{
+const __attribute__((aligned({max(args.align, 4)}))) uint8_t {varname}[] = {{
 {out_data}}};
 '''
 
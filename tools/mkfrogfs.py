@@ -3,40 +3,91 @@
 import configparser
 import csv
 import gzip
+import hashlib
+import heapq
+import mimetypes
 import os
+import pickle
 import sys
 from argparse import ArgumentParser
+from concurrent.futures import ProcessPoolExecutor
 from struct import Struct
 from zlib import crc32
 
 import heatshrink2
 
-frogfs_fs_header_t = Struct('<IBBHIHH')
-# magic, len, version_major, version_minor, binary_len, num_objects, reserved
+frogfs_fs_header_t = Struct('<IBBHIHHHHIIBB2xII')
+# magic, len, version_major, version_minor, binary_len, num_objects,
+# num_mph_buckets, root_child_count, dict_len, dict_offset, payload_offset,
+# align_sz2, hash_prefix_sz2, crc_offset, base_crc32
 FROGFS_MAGIC = 0x676F7246 # Frog
-FROGFS_VERSION_MAJOR = 1
+FROGFS_VERSION_MAJOR = 6
 FROGFS_VERSION_MINOR = 0
 
-frogfs_hashtable_entry_t = Struct('<II')
-# hash, offset
+frogfs_hash_prefix_entry_t = Struct('<H')
+# first
+
+frogfs_hash_entry_t = Struct('<I')
+# hash
+
+frogfs_hash_ref_t = Struct('<IH2x')
+# offset, path_len
 
 frogfs_sorttable_entry_t = Struct('<I')
 # offset
 
+frogfs_mph_slot_t = Struct('<I')
+# offset
+
+frogfs_mph_bucket_t = Struct('<H')
+# seed
+
+frogfs_crc_entry_t = Struct('<I')
+# crc32
+
 frogfs_object_header_t = Struct('<BBHHH')
 # type, len, index, path_len, reserved
-FROGFS_TYPE_FILE = 0
-FROGFS_TYPE_DIR  = 1
+FROGFS_TYPE_FILE    = 0
+FROGFS_TYPE_DIR     = 1
+FROGFS_TYPE_DELETED = 2
+
+frogfs_dir_header_t = Struct('<HH')
+# child_index, child_count
 
-frogfs_file_header_t = Struct('<IIHBB')
-# data_len, file_len, flags, compression, reserved
-FROGFS_FLAG_GZIP  = (1 << 0)
-FROGFS_FLAG_CACHE = (1 << 1)
+frogfs_file_header_t = Struct('<IIIHBB')
+# data_offset, data_len, file_len, flags, compression, num_variants
+FROGFS_FLAG_GZIP     = (1 << 0)
+FROGFS_FLAG_CACHE    = (1 << 1)
+FROGFS_FLAG_TEMPLATE = (1 << 2)
 FROGFS_COMPRESSION_NONE       = 0
 FROGFS_COMPRESSION_HEATSHRINK = 1
+FROGFS_COMPRESSION_LZ4        = 2
+
+frogfs_meta_header_t = Struct('<BBBB')
+# mime_type_len, content_length_len, etag_len, cache_control_len
+
+frogfs_variant_entry_t = Struct('<IIIB3x')
+# offset, len, crc32, encoding
+FROGFS_ENCODING_GZIP   = 1
+FROGFS_ENCODING_BROTLI = 2
+
+frogfs_template_header_t = Struct('<HH')
+# num_segments, names_len
 
-frogfs_heatshrink_header_t = Struct('<BBH')
-# window_sz2, lookahead_sz2
+frogfs_template_segment_t = Struct('<IHBx')
+# offset, len, type
+FROGFS_SEGMENT_LITERAL = 0
+FROGFS_SEGMENT_TOKEN   = 1
+
+frogfs_heatshrink_header_t = Struct('<BBBB')
+# window_sz2, lookahead_sz2, block_sz2, flags
+FROGFS_HEATSHRINK_DICT = (1 << 0)
+
+frogfs_lz4_header_t = Struct('<B3x')
+# block_sz2
+
+frogfs_seektable_entry_t = Struct('<I')
+# offset
 
 frogfs_crc32_footer_t = Struct('<I')
 # crc32
@@ -47,11 +98,349 @@ def djb2_hash(s):
         hash = ((hash << 5) + hash ^ c) & 0xFFFFFFFF
     return hash
 
+def fnv1a_hash(s):
+    hash = 2166136261
+    for c in s.encode('utf8'):
+        hash = ((hash ^ c) * 16777619) & 0xFFFFFFFF
+    return hash
+
+def fmix32(h):
+    h ^= h >> 16
+    h = (h * 0x85EBCA6B) & 0xFFFFFFFF
+    h ^= h >> 13
+    h = (h * 0xC2B2AE35) & 0xFFFFFFFF
+    h ^= h >> 16
+    return h
+
+def index_hash(s):
+    return fmix32(fnv1a_hash(s))
+
+def hash_prefix_sz2(num_objects):
+    # about 8 hashes, a 32 byte cache line, share each prefix
+    return (max(num_objects - 1, 0) // 8).bit_length()
+
+def hash_prefixes_len(sz2):
+    return (frogfs_hash_prefix_entry_t.size * ((1 << sz2) + 1) + 3) // 4 * 4
+
+def hash_index_len(num_objects, sz2):
+    return hash_prefixes_len(sz2) + (frogfs_hash_entry_t.size +
+            frogfs_hash_ref_t.size) * num_objects
+
+def make_hash_index(hashes, sz2):
+    # a prefix table, then the hashes sorted by hash and their references
+    hashes = sorted(hashes)
+    prefixes = bytearray(hash_prefixes_len(sz2))
+    first = 0
+    for prefix in range((1 << sz2) + 1):
+        while first < len(hashes) and hashes[first][0] >> (32 - sz2) < prefix:
+            first += 1
+        frogfs_hash_prefix_entry_t.pack_into(prefixes,
+                frogfs_hash_prefix_entry_t.size * prefix, first)
+    return b''.join([prefixes] +
+            [frogfs_hash_entry_t.pack(entry[0]) for entry in hashes] +
+            [frogfs_hash_ref_t.pack(*entry[1:]) for entry in hashes])
+
+def mph_slot(key, seed, num_slots):
+    hash, path_hash = key
+    return fmix32(hash ^ ((path_hash + seed * 0x9E3779B9) & 0xFFFFFFFF)) % \
+            num_slots
+
+def build_mph(paths):
+    '''Build a minimal perfect hash using hash and displace.
+
+    Returns a list of bucket seeds and a list mapping each slot to an index
+    into paths, or None if no perfect hash could be found.'''
+    num_slots = len(paths)
+    keys = [(djb2_hash(path), fnv1a_hash(path)) for path in paths]
+
+    # fewer buckets make smaller tables, but become harder to solve
+    for keys_per_bucket in (4, 3, 2, 1):
+        num_buckets = (num_slots + keys_per_bucket - 1) // keys_per_bucket
+        if num_buckets == 0 or num_buckets > 0xFFFF:
+            continue
+        buckets = [[] for _ in range(num_buckets)]
+        for i, key in enumerate(keys):
+            buckets[fmix32(key[0]) % num_buckets].append(i)
+
+        seeds = [0] * num_buckets
+        slots = [None] * num_slots
+        order = sorted(range(num_buckets), key=lambda b: -len(buckets[b]))
+        for bucket in order:
+            members = buckets[bucket]
+            if not members:
+                continue
+            for seed in range(0x10000):
+                taken = [mph_slot(keys[i], seed, num_slots) for i in members]
+                if len(set(taken)) == len(taken) and \
+                        all(slots[slot] is None for slot in taken):
+                    break
+            else:
+                break
+            seeds[bucket] = seed
+            for i, slot in zip(members, taken):
+                slots[slot] = i
+        else:
+            return seeds, slots
+
+    return None
+
+def compress_blocks(data, block_sz2, compress):
+    '''Compress data as independent streams of (1 << block_sz2) bytes each,
+    preceded by a seek table so that any block can be decoded directly.'''
+    seektable = []
+    blocks = []
+    blocks_len = 0
+    for offset in range(0, len(data), 1 << block_sz2):
+        seektable.append(frogfs_seektable_entry_t.pack(blocks_len))
+        blocks.append(compress(data[offset:offset + (1 << block_sz2)]))
+        blocks_len += len(blocks[-1])
+    return b''.join(seektable + blocks)
+
+def heatshrink_encode(data, window_sz2, lookahead_sz2, prefix):
+    '''Encode data as a heatshrink stream whose window starts out holding
+    prefix, as it does for a decoder primed with the same bytes.'''
+    buf = prefix + data
+    max_dist = 1 << window_sz2
+    max_len = 1 << lookahead_sz2
+    # a backref must cost fewer bits than the literals it replaces
+    min_len = max(3, (1 + window_sz2 + lookahead_sz2) // 9 + 1)
+
+    out = bytearray()
+    acc = 0
+    nbits = 0
+    def put(value, count):
+        nonlocal acc, nbits
+        acc = (acc << count) | value
+        nbits += count
+        while nbits >= 8:
+            nbits -= 8
+            out.append((acc >> nbits) & 0xFF)
+        acc &= (1 << nbits) - 1
+
+    chains = {}
+    def insert(i):
+        chains.setdefault(buf[i:i + 3], []).append(i)
+
+    for i in range(max(len(prefix) - 2, 0)):
+        insert(i)
+
+    i = len(prefix)
+    while i < len(buf):
+        best_len = 0
+        best_dist = 0
+        limit = min(max_len, len(buf) - i)
+        if limit >= min_len:
+            chain = chains.get(buf[i:i + 3], ())
+            for j in reversed(chain[-64:]):
+                if i - j > max_dist:
+                    break
+                n = 3
+                while n < limit and buf[j + n] == buf[i + n]:
+                    n += 1
+                if n > best_len:
+                    best_len, best_dist = n, i - j
+                    if n == limit:
+                        break
+
+        if best_len >= min_len:
+            put(0, 1)
+            put(best_dist - 1, window_sz2)
+            put(best_len - 1, lookahead_sz2)
+        else:
+            best_len = 1
+            put(1, 1)
+            put(buf[i], 8)
+        for j in range(i, i + best_len):
+            if j >= 2:
+                insert(j - 2)
+        i += best_len
+
+    if nbits:
+        out.append((acc << (8 - nbits)) & 0xFF)
+    return bytes(out)
+
+def heatshrink_compress(data, window_sz2, lookahead_sz2, block_sz2,
+        dictionary=b''):
+    '''Compress data with heatshrink, against the dictionary too when one
+    is given, and keep whichever is smaller.'''
+    def compress(flags, compress):
+        header = frogfs_heatshrink_header_t.pack(window_sz2, lookahead_sz2,
+                block_sz2, flags)
+        if not block_sz2:
+            return header + compress(data)
+        return header + compress_blocks(data, block_sz2, compress)
+
+    best = compress(0, lambda data: heatshrink2.compress(data,
+            window_sz2=window_sz2, lookahead_sz2=lookahead_sz2))
+    if dictionary:
+        primed = compress(FROGFS_HEATSHRINK_DICT, lambda data:
+                heatshrink_encode(data, window_sz2, lookahead_sz2,
+                dictionary[-(1 << window_sz2):]))
+        if len(primed) < len(best):
+            best = primed
+    return best
+
+def train_dictionary(samples, dict_len, segment_len=32, dmer_len=6):
+    '''Build a dictionary from the segments of samples that hold the most
+    substrings shared with other samples, the most useful segments last so
+    they stay in the window longest.'''
+    counts = {}
+    for sample in samples:
+        for dmer in {sample[i:i + dmer_len]
+                for i in range(len(sample) - dmer_len + 1)}:
+            counts[dmer] = counts.get(dmer, 0) + 1
+
+    def score(segment):
+        return sum(counts.get(dmer, 1) - 1 for dmer in
+                {segment[i:i + dmer_len]
+                for i in range(len(segment) - dmer_len + 1)})
+
+    heap = []
+    seen = set()
+    for sample in samples:
+        for i in range(0, max(len(sample) - dmer_len, 0) + 1, segment_len // 2):
+            segment = sample[i:i + segment_len]
+            if segment not in seen:
+                seen.add(segment)
+                heap.append((-score(segment), segment))
+    heapq.heapify(heap)
+
+    # scores only drop as segments are chosen, so a rescored segment that
+    # still beats the next best is the best
+    chosen = []
+    total = 0
+    while heap and total < dict_len:
+        _, segment = heapq.heappop(heap)
+        value = score(segment)
+        if value <= 0:
+            continue
+        if heap and value < -heap[0][0]:
+            heapq.heappush(heap, (-value, segment))
+            continue
+        chosen.append(segment)
+        total += len(segment)
+        for i in range(len(segment) - dmer_len + 1):
+            counts.pop(segment[i:i + dmer_len], None)
+
+    return b''.join(reversed(chosen))[-dict_len:]
+
+def file_dictionary(data):
+    '''Return the dictionary to try compressing data against.'''
+    global config, dictionary
+
+    max_file_len = int(config['heatshrink'].get('dict_max_file_len', 4096))
+    if len(data) > max_file_len:
+        return b''
+    return dictionary
+
+def make_dictionary(state):
+    '''Train the image dictionary on the small heatshrink files.'''
+    global config
+
+    dict_len = int(config['heatshrink'].get('dict_len', 0))
+    max_file_len = int(config['heatshrink'].get('dict_max_file_len', 4096))
+    window_sz2 = int(config['heatshrink']['window_sz2'])
+    dict_len = min(dict_len, 1 << window_sz2)
+    if dict_len <= 0:
+        return b''
+
+    samples = []
+    for (_, path), item in state.items():
+        if item['type'] != 'file' or \
+                item['compressor'] not in ('auto', 'heatshrink'):
+            continue
+        with open(os.path.join(args.src_dir, path), 'rb') as f:
+            data = f.read()
+        if len(data) <= max_file_len:
+            samples.append(data)
+
+    if len(samples) < 2:
+        return b''
+    return train_dictionary(samples, dict_len)
+
+# the runtime decodes a whole LZ4 block, or a whole file stored without blocks,
+# into a buffer per open file, so both are limited to this size
+LZ4_MAX_BLOCK_SZ2 = 16
+
+def lz4_compress(data, block_sz2, level):
+    import lz4.block
+
+    header = frogfs_lz4_header_t.pack(block_sz2)
+    compress = lambda data: lz4.block.compress(data, mode='high_compression',
+            compression=level, store_size=False)
+    if not block_sz2:
+        return header + compress(data)
+    return header + compress_blocks(data, block_sz2, compress)
+
+# rough decode cost per output byte on the device, relative to LZ4
+DECODE_COST = {
+    'gzip': 0, # decoded by the client
+    'lz4': 1,
+    'heatshrink': 8,
+}
+
+# heatshrink decoders also allocate an input buffer, 128 bytes by default
+HEATSHRINK_INPUT_BUFFER = 128
+
+def auto_candidates(data):
+    '''Yield (compressor, description, decoder RAM, compress function)
+    for every codec and parameter set auto may choose from.'''
+    global config
+
+    codecs = config.get('auto', 'codecs', fallback='heatshrink,lz4').split(',')
+
+    if 'heatshrink' in codecs:
+        block_sz2 = int(config['heatshrink'].get('block_sz2', 0))
+        for window_sz2 in range(8, 14):
+            for lookahead_sz2 in range(3, 7):
+                yield ('heatshrink', f'heatshrink {window_sz2}/{lookahead_sz2}',
+                        (1 << window_sz2) + HEATSHRINK_INPUT_BUFFER,
+                        lambda w=window_sz2, l=lookahead_sz2:
+                        heatshrink_compress(data, w, l, block_sz2,
+                        file_dictionary(data)))
+
+    if 'lz4' in codecs:
+        level = int(config['lz4']['level'])
+        level = min(max(level, 1), 12)
+        for block_sz2 in (10, 12, 14, 16):
+            yield ('lz4', f'lz4 {block_sz2}',
+                    min(1 << block_sz2, len(data)),
+                    lambda b=block_sz2: lz4_compress(data, b, level))
+            if (1 << block_sz2) >= len(data):
+                break
+
+    if 'gzip' in codecs:
+        level = int(config['gzip']['level'])
+        level = min(max(level, 0), 9)
+        yield ('gzip', 'gzip', 0, lambda: gzip.compress(data, level,
+                mtime=0))
+
+def auto_compress(data):
+    '''Pick the smallest encoding of data within the configured decoder RAM
+    and decode cost budgets, where 0 means unlimited.
+
+    Returns the compressor, a description of the choice and the data.'''
+    global config
+
+    max_ram = int(config.get('auto', 'max_ram', fallback='0'))
+    max_decode_cost = int(config.get('auto', 'max_decode_cost', fallback='0'))
+
+    best = ('uncompressed', 'uncompressed', data)
+    for compressor, description, ram, compress in auto_candidates(data):
+        if max_ram and ram > max_ram:
+            continue
+        if max_decode_cost and DECODE_COST[compressor] > max_decode_cost:
+            continue
+        candidate = compress()
+        if len(candidate) < len(best[2]):
+            best = (compressor, description, candidate)
+
+    return best
+
 def load_state(path):
     state = dict()
     state_file = os.path.join(args.src_dir, '.state')
     with open(state_file, newline='') as f:
-        index = 0
         reader = csv.reader(f, quoting=csv.QUOTE_NONNUMERIC)
         for data in reader:
             path, type, _, flags, compressor = data
@@ -59,26 +448,180 @@ def load_state(path):
             flags = () if not flags else tuple(flags.split(','))
             if 'discard' in flags:
                 continue
+            if type == 'file' and \
+                    not os.path.exists(os.path.join(args.src_dir, path)):
+                continue
             state[(hash, path)] = {
-                'index': index,
                 'type': type,
                 'flags': flags,
                 'compressor': compressor,
             }
-            index += 1
 
     return dict(sorted(state.items()))
 
+def assign_indexes(state):
+    '''Number objects breadth first, directories before files, so that the
+    children of every directory have consecutive indexes.
+
+    Sets index on every item and child_index/child_count on directories, and
+    returns the number of children of the root directory.'''
+    children = {'': []}
+    for (_, path), item in state.items():
+        children.setdefault(path.rpartition('/')[0], []).append((path, item))
+        if item['type'] == 'dir':
+            children.setdefault(path, [])
+
+    index = 0
+    queue = [('', None)]
+    while queue:
+        path, dir = queue.pop(0)
+        entries = sorted(children[path], key=lambda e: (e[1]['type'] != 'dir',
+                e[0]))
+        if dir is not None:
+            dir['child_index'] = index
+            dir['child_count'] = len(entries)
+        for child_path, child in entries:
+            child['index'] = index
+            index += 1
+            if child['type'] == 'dir':
+                queue.append((child_path, child))
+
+    # a delta image also holds objects whose parent directory it doesn't,
+    # replacements and tombstones, which come last
+    for (_, path), item in state.items():
+        if 'index' not in item:
+            item['index'] = index
+            index += 1
+
+    return len(children[''])
+
 def make_dir_object(item):
     print(f'{item[0][0]:08x} {item[0][1]:<34s} dir')
 
     path = item[0][1].encode('utf8') + b'\0'
     path = path.ljust((len(path) + 3) // 4 * 4, b'\0')
     header = frogfs_object_header_t.pack(FROGFS_TYPE_DIR,
-            frogfs_object_header_t.size, item[1]['index'], len(path), 0)
+            frogfs_object_header_t.size + frogfs_dir_header_t.size,
+            item[1]['index'], len(path), 0) + frogfs_dir_header_t.pack(
+            item[1]['child_index'], item[1]['child_count'])
     return header + path
 
-def make_file_object(item, data):
+def make_deleted_object(item):
+    print(f'{item[0][0]:08x} {item[0][1]:<34s} deleted')
+
+    path = item[0][1].encode('utf8') + b'\0'
+    path = path.ljust((len(path) + 3) // 4 * 4, b'\0')
+    return frogfs_object_header_t.pack(FROGFS_TYPE_DELETED,
+            frogfs_object_header_t.size, item[1]['index'], len(path), 0) + path
+
+def make_meta(path, flags, data):
+    '''Build the metadata header and strings for a file, given the data as
+    it will be served.'''
+    global config
+
+    mime_type = mimetypes.guess_type(path)[0] or ''
+    content_length = str(len(data))
+    etag = f'"{crc32(data) & 0xFFFFFFFF:08x}"'
+    cache_control = ''
+    if 'cache' in flags:
+        cache_control = config.get('metadata', 'cache_control', fallback='')
+
+    values = [v.encode('utf8') + b'\0' if v else b''
+            for v in (mime_type, content_length, etag, cache_control)]
+    meta = frogfs_meta_header_t.pack(*[len(v) for v in values]) + \
+            b''.join(values)
+    return meta.ljust((len(meta) + 3) // 4 * 4, b'\0')
+
+def make_variants(item, data, served_len):
+    '''Compress the precompressed variants requested for a file, keeping
+    only those smaller than what would be served otherwise.'''
+    global config
+
+    variants = []
+    if 'gzip-variant' in item[1]['flags']:
+        level = int(config['gzip']['level'])
+        level = min(max(level, 0), 9)
+        variants.append((FROGFS_ENCODING_GZIP, gzip.compress(data, level,
+                mtime=0)))
+    if 'brotli-variant' in item[1]['flags']:
+        import brotli
+        quality = int(config['brotli']['quality'])
+        quality = min(max(quality, 0), 11)
+        variants.append((FROGFS_ENCODING_BROTLI, brotli.compress(data,
+                quality=quality)))
+
+    return [v for v in variants if len(v[1]) < served_len]
+
+def make_variant_table(variants, offset):
+    '''Build the variant table for variant data stored from offset on.'''
+    table = []
+    for encoding, data in variants:
+        table.append(frogfs_variant_entry_t.pack(offset, len(data),
+                crc32(data) & 0xFFFFFFFF, encoding))
+        offset += (len(data) + 3) // 4 * 4
+    return b''.join(table)
+
+def make_template(path, data):
+    '''Split template data into literal runs and %token% references, the way
+    the template route would scan it, and build the segment table.'''
+    segments = []
+    names = b''
+    name_offsets = {}
+
+    def literal(offset, length):
+        if segments and segments[-1][0] == FROGFS_SEGMENT_LITERAL and \
+                segments[-1][1] + segments[-1][2] == offset:
+            offset, length = segments[-1][1], segments[-1][2] + length
+            segments.pop()
+        while length:
+            n = min(length, 0xFFFF)
+            segments.append((FROGFS_SEGMENT_LITERAL, offset, n))
+            offset += n
+            length -= n
+
+    pos = 0
+    while True:
+        start = data.find(b'%', pos)
+        end = data.find(b'%', start + 1) if start >= 0 else -1
+        if end < 0:
+            # an unterminated token is dropped, like the route does
+            literal(pos, (start if start >= 0 else len(data)) - pos)
+            break
+        literal(pos, start - pos)
+        if end == start + 1:
+            # %% is an escaped %
+            literal(start, 1)
+        else:
+            name = data[start + 1:end]
+            if name not in name_offsets:
+                name_offsets[name] = len(names)
+                names += name + b'\0'
+            segments.append((FROGFS_SEGMENT_TOKEN, name_offsets[name],
+                    len(name)))
+        pos = end + 1
+
+    if len(segments) > 0xFFFF or len(names) > 0xFFFF:
+        print(f'template {path} too large to precompile', file=sys.stderr)
+        return b''
+
+    names = names.ljust((len(names) + 3) // 4 * 4, b'\0')
+    return frogfs_template_header_t.pack(len(segments), len(names)) + \
+            b''.join(frogfs_template_segment_t.pack(offset, length, type)
+            for type, offset, length in segments) + names
+
+def make_payload(blob):
+    '''Build the stored data of a blob, followed by its variant data.'''
+    payload = blob['data']
+    blob['variants_offset'] = 0
+    if blob['variants']:
+        payload = payload.ljust((len(payload) + 3) // 4 * 4, b'\0')
+        blob['variants_offset'] = len(payload)
+        payload += b''.join(data.ljust((len(data) + 3) // 4 * 4, b'\0')
+                for _, data in blob['variants'])
+    return payload
+
+def compress_file(item, data):
+    '''Compress a file's data and make its variants.'''
     global config
 
     flags = 0
@@ -86,21 +629,37 @@ def make_file_object(item, data):
     initial_data_len = len(data)
     inital_data = data
 
-    if 'cache' in item[1]['flags']:
-        flags |= FROGFS_FLAG_CACHE
-
-    if item[1]['compressor'] == 'gzip':
-        flags |= FROGFS_FLAG_GZIP
+    compressor = item[1]['compressor']
+    choice = None
+    if compressor == 'auto':
+        compressor, choice, data = auto_compress(data)
+    elif compressor == 'gzip':
         level = int(config['gzip']['level'])
         level = min(max(level, 0), 9)
-        data = gzip.compress(data, level)
-    elif item[1]['compressor'] == 'heatshrink':
-        compression = FROGFS_COMPRESSION_HEATSHRINK
+        data = gzip.compress(data, level, mtime=0)
+    elif compressor == 'heatshrink':
         window_sz2 = int(config['heatshrink']['window_sz2'])
         lookahead_sz2 = int(config['heatshrink']['lookahead_sz2'])
-        data = frogfs_heatshrink_header_t.pack(window_sz2, lookahead_sz2, 0) + \
-                heatshrink2.compress(data, window_sz2=window_sz2,
-                lookahead_sz2=lookahead_sz2)
+        block_sz2 = int(config['heatshrink'].get('block_sz2', 0))
+        data = heatshrink_compress(data, window_sz2, lookahead_sz2, block_sz2,
+                file_dictionary(data))
+    elif compressor == 'lz4':
+        block_sz2 = int(config['lz4']['block_sz2'])
+        if block_sz2 > LZ4_MAX_BLOCK_SZ2 or (block_sz2 == 0 and
+                len(data) > 1 << LZ4_MAX_BLOCK_SZ2):
+            print(f'{item[0][1]}: lz4 block_sz2 {block_sz2} limited to '
+                    f'{LZ4_MAX_BLOCK_SZ2}', file=sys.stderr)
+            block_sz2 = LZ4_MAX_BLOCK_SZ2
+        level = int(config['lz4']['level'])
+        level = min(max(level, 1), 12)
+        data = lz4_compress(data, block_sz2, level)
+
+    if compressor == 'gzip':
+        flags |= FROGFS_FLAG_GZIP
+    elif compressor == 'heatshrink':
+        compression = FROGFS_COMPRESSION_HEATSHRINK
+    elif compressor == 'lz4':
+        compression = FROGFS_COMPRESSION_LZ4
 
     data_len = len(data)
 
@@ -124,67 +683,446 @@ def make_file_object(item, data):
     if initial_data_len > 0:
         percent *= data_len / initial_data_len
 
+    variants = make_variants(item, inital_data,
+            data_len if flags & FROGFS_FLAG_GZIP else initial_data_len)
+
     stats = f'{initial_data_len_str:<9s} -> {data_len_str:<9s} ({percent:.1f}%)'
-    print(f'{item[0][0]:08x} {item[0][1]:<34s} file {stats}')
+    if choice:
+        stats += f' auto: {choice if data_len < initial_data_len else "none"}'
+    if compression == FROGFS_COMPRESSION_HEATSHRINK and \
+            data[3] & FROGFS_HEATSHRINK_DICT:
+        stats += ' dict'
+    for encoding, variant in variants:
+        name = 'br' if encoding == FROGFS_ENCODING_BROTLI else 'gzip'
+        stats += f' {name} ({100.0 * len(variant) / initial_data_len:.1f}%)'
+
+    return {
+        'flags': flags,
+        'compression': compression,
+        'data': data,
+        'file_len': data_len if flags & FROGFS_FLAG_GZIP else initial_data_len,
+        'served': data if flags & FROGFS_FLAG_GZIP else inital_data,
+        'variants': variants,
+        'stats': stats,
+    }
+
+def blob_key(item, data):
+    '''Files with the same content, compressor and variants share a blob.'''
+    flags = item[1]['flags']
+    return (hashlib.sha256(data).digest(), item[1]['compressor'],
+            'gzip-variant' in flags, 'brotli-variant' in flags)
+
+def init_worker(worker_config, worker_dictionary):
+    global config, dictionary
+
+    config = worker_config
+    dictionary = worker_dictionary
+
+def compress_job(job):
+    item, data = job
+    return compress_file(item, data)
+
+def is_cache_file(name):
+    '''Return whether name is that of a blob this cache writes.'''
+    if name.endswith('.tmp'):
+        name = name[:-4]
+    return len(name) == 64 and all(c in '0123456789abcdef' for c in name)
+
+def compress_files(files):
+    '''Compress the first file of each blob key in files, on a process pool,
+    reusing blobs cached by earlier builds with the same parameters.'''
+    global args, config, dictionary
+
+    cache_dir = None
+    if not args.no_cache:
+        cache_dir = args.cache or os.path.join(args.src_dir, '.cache')
+        os.makedirs(cache_dir, exist_ok=True)
+
+    # anything that changes the output of compress_file changes the salt
+    salt = hashlib.sha256()
+    with open(__file__, 'rb') as f:
+        salt.update(f.read())
+    salt.update(repr(sorted((section, sorted(config[section].items()))
+            for section in config.sections())).encode('utf8'))
+    salt.update(dictionary)
+
+    blobs = {}
+    jobs = []
+    cache_files = {}
+    for key, (item, data) in files.items():
+        name = hashlib.sha256(salt.digest() + repr(key).encode('utf8'))
+        cache_files[key] = name.hexdigest()
+        if cache_dir:
+            try:
+                with open(os.path.join(cache_dir, cache_files[key]), 'rb') as f:
+                    blobs[key] = pickle.load(f)
+                blobs[key]['stats'] += ' (cached)'
+                continue
+            except (OSError, EOFError, pickle.UnpicklingError):
+                pass
+        jobs.append((key, item, data))
+
+    work = [(item, data) for _, item, data in jobs]
+    if args.jobs == 1 or len(jobs) < 2:
+        results = map(compress_job, work)
+    else:
+        with ProcessPoolExecutor(args.jobs or None, initializer=init_worker,
+                initargs=(config, dictionary)) as pool:
+            results = list(pool.map(compress_job, work, chunksize=8))
+
+    for (key, _, _), blob in zip(jobs, results):
+        blobs[key] = blob
+        if cache_dir:
+            path = os.path.join(cache_dir, cache_files[key])
+            with open(path + '.tmp', 'wb') as f:
+                pickle.dump(blob, f)
+            os.replace(path + '.tmp', path)
+
+    # keep only what this image uses, so the default cache does not grow
+    # forever; a --cache directory may be shared with other images, so its
+    # blobs are left alone
+    if cache_dir and not args.cache:
+        used = set(cache_files.values())
+        for name in os.listdir(cache_dir):
+            path = os.path.join(cache_dir, name)
+            if is_cache_file(name) and name not in used and \
+                    os.path.isfile(path):
+                os.unlink(path)
+
+    if jobs or blobs:
+        print(f'{len(jobs)} files compressed, {len(blobs) - len(jobs)} cached')
+    return blobs
 
-    if flags & FROGFS_FLAG_GZIP:
-        initial_data_len = data_len
+def file_object_len(item):
+    '''Return the length of an object, including its path, variant table and
+    template segments.'''
+    path_len = (len(item[0][1].encode('utf8')) + 1 + 3) // 4 * 4
+    if item[1]['type'] == 'dir':
+        return frogfs_object_header_t.size + frogfs_dir_header_t.size + \
+                path_len
+    if item[1]['type'] == 'deleted':
+        return frogfs_object_header_t.size + path_len
+    return frogfs_object_header_t.size + frogfs_file_header_t.size + \
+            len(item[1]['meta']) + path_len + \
+            frogfs_variant_entry_t.size * len(item[1]['blob']['variants']) + \
+            len(item[1]['template'])
+
+def file_flags(item):
+    '''Return the flags stored in a file's header.'''
+    flags = item[1]['blob']['flags']
+    if 'cache' in item[1]['flags']:
+        flags |= FROGFS_FLAG_CACHE
+    if item[1]['template']:
+        flags |= FROGFS_FLAG_TEMPLATE
+    return flags
+
+def file_signature(item):
+    '''Everything about a file that ends up in its object or stored data,
+    except where that data is located.'''
+    blob = item[1]['blob']
+    return (file_flags(item), blob['compression'], blob['file_len'],
+            item[1]['meta'], item[1]['template'], blob['data'],
+            tuple(blob['variants']))
+
+def load_base(path):
+    '''Read the objects of a base image to build a delta image against.
+
+    Returns a dictionary of paths to ('dir', None) or ('file', signature)
+    and the checksum that identifies the base image.'''
+    with open(path, 'rb') as f:
+        image = f.read()
+
+    header_len = image[4] if len(image) > 4 else 0
+    header = image[:header_len].ljust(frogfs_fs_header_t.size, b'\0')
+    magic, _, version_major, _, _, num_objects, num_mph_buckets, _, _, _, \
+            payload_offset, _, prefix_sz2, _, base_crc32 = \
+            frogfs_fs_header_t.unpack(header)
+    if magic != FROGFS_MAGIC or version_major != FROGFS_VERSION_MAJOR:
+        print(f'{path} is not a supported frogfs image', file=sys.stderr)
+        sys.exit(1)
+    if base_crc32 != 0:
+        print(f'{path} is a delta image, use a full image as the base',
+                file=sys.stderr)
+        sys.exit(1)
+
+    objects = {}
+    sorttable = header_len
+    if num_mph_buckets == 0:
+        sorttable += hash_index_len(num_objects, prefix_sz2)
+    for i in range(num_objects):
+        offset, = frogfs_sorttable_entry_t.unpack_from(image,
+                sorttable + frogfs_sorttable_entry_t.size * i)
+        type, object_len, _, path_len, _ = \
+                frogfs_object_header_t.unpack_from(image, offset)
+        name = image[offset + object_len:offset + object_len + path_len]
+        name = name.split(b'\0')[0].decode('utf8')
+        if type == FROGFS_TYPE_DIR:
+            objects[name] = ('dir', None)
+            continue
+
+        data_offset, data_len, file_len, flags, compression, num_variants = \
+                frogfs_file_header_t.unpack_from(image,
+                offset + frogfs_object_header_t.size)
+        meta = image[offset + frogfs_object_header_t.size +
+                frogfs_file_header_t.size:offset + object_len]
+        table = offset + object_len + path_len
+        variants = []
+        for j in range(num_variants):
+            variant_offset, variant_len, _, encoding = \
+                    frogfs_variant_entry_t.unpack_from(image,
+                    table + frogfs_variant_entry_t.size * j)
+            variants.append((encoding,
+                    image[variant_offset:variant_offset + variant_len]))
+        template = b''
+        if flags & FROGFS_FLAG_TEMPLATE:
+            start = table + frogfs_variant_entry_t.size * num_variants
+            num_segments, names_len = \
+                    frogfs_template_header_t.unpack_from(image, start)
+            template = image[start:start + frogfs_template_header_t.size +
+                    frogfs_template_segment_t.size * num_segments +
+                    names_len]
+        objects[name] = ('file', (flags, compression, file_len, meta,
+                template, image[data_offset:data_offset + data_len],
+                tuple(variants)))
+
+    return objects, crc32(image[:payload_offset]) & 0xFFFFFFFF
+
+def make_delta(state, base):
+    '''Reduce state to the objects that differ from the base image and
+    tombstones for the paths it removes.
+
+    Replaced objects are found through the base directory listings, so only
+    added objects bring their parent directories along.'''
+    keep = set()
+    for item in state.items():
+        path = item[0][1]
+        if item[1]['type'] == 'dir':
+            if base.get(path, (None,))[0] != 'dir':
+                keep.add(path)
+        elif base.get(path) != ('file', file_signature(item)):
+            keep.add(path)
+
+    for path in list(keep):
+        if path in base:
+            continue
+        while '/' in path:
+            path = path.rpartition('/')[0]
+            keep.add(path)
+
+    paths = {path for _, path in state}
+    delta = {}
+    for (hash, path), item in state.items():
+        if path in keep:
+            delta[(hash, path)] = {k: v for k, v in item.items()
+                    if k not in ('index', 'child_index', 'child_count')}
+    for path in base:
+        if path not in paths:
+            delta[(djb2_hash(path), path)] = {
+                'type': 'deleted',
+                'flags': (),
+                'compressor': 'uncompressed',
+            }
+
+    return dict(sorted(delta.items()))
+
+def make_file_object(item):
+    '''Make a file object. The first file using a blob stores its data;
+    later duplicates refer to that copy.'''
+    blob = item[1]['blob']
+    if blob['path'] != item[0][1]:
+        print(f'{item[0][0]:08x} {item[0][1]:<34s} file duplicate of '
+                f'{blob["path"]}')
+    else:
+        print(f'{item[0][0]:08x} {item[0][1]:<34s} file {blob["stats"]}')
+
+    flags = file_flags(item)
+    meta = item[1]['meta']
+    header_len = frogfs_object_header_t.size + frogfs_file_header_t.size + \
+            len(meta)
+    if header_len > 0xFF:
+        print(f'metadata too long for {item[0][1]}', file=sys.stderr)
+        sys.exit(1)
 
     path = item[0][1].encode('utf8') + b'\0'
     path = path.ljust((len(path) + 3) // 4 * 4, b'\0')
-    header = frogfs_object_header_t.pack(FROGFS_TYPE_FILE,
-            frogfs_object_header_t.size + frogfs_file_header_t.size,
+
+    header = frogfs_object_header_t.pack(FROGFS_TYPE_FILE, header_len,
             item[1]['index'], len(path), 0) + frogfs_file_header_t.pack(
-            data_len, initial_data_len, flags, compression, 0)
+            blob['offset'], len(blob['data']), blob['file_len'], flags,
+            blob['compression'], len(blob['variants'])) + meta
+    table = make_variant_table(blob['variants'],
+            blob['offset'] + blob['variants_offset'])
 
-    return header + path + data
+    return header + path + table + item[1]['template']
 
 def main():
-    global args, config
+    global args, config, dictionary
 
     parser = ArgumentParser()
     parser.add_argument('src_dir', metavar='SRC', help='source directory')
     parser.add_argument('dst_bin', metavar='DST', help='destination binary')
     parser.add_argument('--config', help='user configuration')
+    parser.add_argument('--no-mph', action='store_true',
+            help='do not build a minimal perfect hash index')
+    parser.add_argument('--align', type=int, default=1,
+            help='align file data to a power of two number of bytes')
+    parser.add_argument('--jobs', '-j', type=int, default=0,
+            help='number of compression processes, default one per CPU')
+    parser.add_argument('--cache', metavar='DIR',
+            help='compressed blob cache directory, default SRC/.cache')
+    parser.add_argument('--no-cache', action='store_true',
+            help='do not read or write the compressed blob cache')
+    parser.add_argument('--base', metavar='BASE',
+            help='build a delta image holding only the changes from BASE')
     args = parser.parse_args()
 
+    if args.align < 1 or args.align & (args.align - 1):
+        print('alignment must be a power of two', file=sys.stderr)
+        sys.exit(1)
+
     config = configparser.ConfigParser()
     config.read(os.path.join(args.src_dir, '.config'))
 
     state = load_state(args.src_dir)
+    dictionary = make_dictionary(state)
+
+    contents = {}
+    files = {}
+    for item in state.items():
+        if item[1]['type'] == 'file':
+            with open(os.path.join(args.src_dir, item[0][1]), 'rb') as f:
+                data = f.read()
+            contents[item[0][1]] = blob_key(item, data)
+            files.setdefault(contents[item[0][1]], (item, data))
+    blobs = compress_files(files)
+
+    for item in state.items():
+        if item[1]['type'] == 'file':
+            blob = blobs[contents[item[0][1]]]
+            item[1]['blob'] = blob
+            item[1]['meta'] = b''
+            if 'meta' in item[1]['flags']:
+                item[1]['meta'] = make_meta(item[0][1], item[1]['flags'],
+                        blob['served'])
+            item[1]['template'] = b''
+            if 'template' in item[1]['flags']:
+                if blob['flags'] & FROGFS_FLAG_GZIP:
+                    print(f'not precompiling gzip template {item[0][1]}',
+                            file=sys.stderr)
+                else:
+                    item[1]['template'] = make_template(item[0][1],
+                            blob['served'])
+        elif item[1]['type'] != 'dir':
+            print(f'unknown object type {item[1]["type"]}', file=sys.stderr)
+            sys.exit(1)
+
+    base_crc32 = 0
+    if args.base:
+        base, base_crc32 = load_base(args.base)
+        state = make_delta(state, base)
+        print(f'{len(state)} objects differ from {args.base}')
+    root_child_count = assign_indexes(state)
 
     num_objects = len(state)
+    mph = None
+    paths = [item[0][1] for item in state.items()]
+    if not args.no_mph and paths:
+        mph = build_mph(paths)
+        if mph is None:
+            print('unable to build perfect hash, using the hash index',
+                    file=sys.stderr)
+    num_mph_buckets = len(mph[0]) if mph else 0
+
+    # the hash index is only needed without a perfect hash
+    prefix_sz2 = 0 if mph else hash_prefix_sz2(num_objects)
     offset = frogfs_fs_header_t.size + \
-            (frogfs_hashtable_entry_t.size * num_objects) + \
             (frogfs_sorttable_entry_t.size * num_objects)
-    hashtable = b''
+    if mph:
+        offset += (frogfs_mph_slot_t.size * num_objects) + \
+                (frogfs_mph_bucket_t.size * num_mph_buckets)
+        offset = (offset + 3) // 4 * 4
+    else:
+        offset += hash_index_len(num_objects, prefix_sz2)
+    crc_offset = offset
+    offset += frogfs_crc_entry_t.size * num_objects
+    dict_offset = offset
+    offset += (len(dictionary) + 3) // 4 * 4
+
+    # objects are sized first, so that the file data can follow them
+    objects_len = 0
+    for item in state.items():
+        objects_len += file_object_len(item)
+
+    payload_offset = offset + objects_len
+    payload_offset += -payload_offset % args.align
+    payloads = [bytes(payload_offset - offset - objects_len)]
+    payload_end = payload_offset
+    duplicates = 0
+    saved_len = 0
+    for item in state.items():
+        if item[1]['type'] != 'file':
+            continue
+        blob = item[1]['blob']
+        if 'offset' in blob:
+            duplicates += 1
+            saved_len += blob['size']
+            continue
+        padding = -payload_end % args.align
+        payload = make_payload(blob)
+        blob['offset'] = payload_end + padding
+        blob['path'] = item[0][1]
+        blob['size'] = len(payload)
+        payloads.append(bytes(padding) + payload)
+        payload_end = blob['offset'] + len(payload)
+
+    hashes = []
     sorttable = bytearray(frogfs_sorttable_entry_t.size * num_objects)
-    objects = b''
+    crctable = bytearray(frogfs_crc_entry_t.size * num_objects)
+    offsets = {}
+    objects = []
 
     for item in state.items():
-        abspath = os.path.join(args.src_dir, item[0][1])
         if item[1]['type'] == 'dir':
             object = make_dir_object(item)
-        elif item[1]['type'] == 'file':
-            if not os.path.exists(abspath):
-                continue
-            with open(abspath, 'rb') as f:
-                data = f.read()
-            object = make_file_object(item, data)
+        elif item[1]['type'] == 'deleted':
+            object = make_deleted_object(item)
         else:
-            print(f'unknown object type {type}', file=sys.stderr)
-            sys.exit(1)
-        hashtable += frogfs_hashtable_entry_t.pack(item[0][0], offset)
+            object = make_file_object(item)
+            frogfs_crc_entry_t.pack_into(crctable,
+                    frogfs_crc_entry_t.size * item[1]['index'],
+                    crc32(item[1]['blob']['data']) & 0xFFFFFFFF)
+        path = item[0][1]
+        hashes.append((index_hash(path), offset, len(path.encode('utf8'))))
         frogfs_sorttable_entry_t.pack_into(sorttable,
                 frogfs_sorttable_entry_t.size * item[1]['index'], offset)
-        objects += object
+        offsets[item[0][1]] = offset
+        objects.append(object)
         offset += len(object)
 
-    binary_len = offset + frogfs_crc32_footer_t.size
+    if duplicates:
+        print(f'{duplicates} duplicate files, {saved_len} bytes saved')
+    if dictionary:
+        print(f'{len(dictionary)} byte dictionary')
+
+    hashindex = b'' if mph else make_hash_index(hashes, prefix_sz2)
+
+    mphtables = b''
+    if mph:
+        seeds, slots = mph
+        mphtables = b''.join([frogfs_mph_slot_t.pack(offsets[paths[i]])
+                for i in slots] + [frogfs_mph_bucket_t.pack(seed)
+                for seed in seeds])
+        mphtables = mphtables.ljust((len(mphtables) + 3) // 4 * 4, b'\0')
+
+    binary_len = payload_end + frogfs_crc32_footer_t.size
     header = frogfs_fs_header_t.pack(FROGFS_MAGIC, frogfs_fs_header_t.size,
             FROGFS_VERSION_MAJOR, FROGFS_VERSION_MINOR, binary_len, num_objects,
-            0)
-    binary = header + hashtable + sorttable + objects
+            num_mph_buckets, root_child_count, len(dictionary),
+            dict_offset if dictionary else 0, payload_offset,
+            args.align.bit_length() - 1, prefix_sz2, crc_offset, base_crc32)
+    dictionary = dictionary.ljust((len(dictionary) + 3) // 4 * 4, b'\0')
+    binary = b''.join([header, hashindex, sorttable, mphtables, crctable,
+            dictionary] + objects + payloads)
     binary += frogfs_crc32_footer_t.pack(crc32(binary) & 0xFFFFFFFF)
 
     with open(args.dst_bin, 'wb') as f:
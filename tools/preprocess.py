@@ -51,6 +51,9 @@ def load_config(user_config_file=None):
                     else:
                         config[sec_name][subsec_name] = subsec
 
+    config.setdefault("metadata", OrderedDict())
+    config["metadata"].update(user_config.get("metadata", {}))
+
     for sec_name in ("compressors", "filters"):
         merge_section(sec_name)
         for subsec_name, subsec in config.get(sec_name, OrderedDict()).items():
@@ -79,10 +82,24 @@ def load_config(user_config_file=None):
     config["filters"] = OrderedDict(sorted(config["filters"].items(), key=pattern_sort))
 
     actions = list()
-    for action in ["cache", "discard"]:
+    for action in [
+        "cache",
+        "discard",
+        "meta",
+        "template",
+        "gzip-variant",
+        "brotli-variant",
+    ]:
         actions.append(action)
         actions.append("no-" + action)
-    actions += ["skip-preprocessing", "gzip", "heatshrink", "uncompressed"]
+    actions += [
+        "skip-preprocessing",
+        "auto",
+        "gzip",
+        "heatshrink",
+        "lz4",
+        "uncompressed",
+    ]
     config["actions"] = actions
 
     for filter, actions in config["filters"].items():
@@ -97,26 +114,47 @@ def load_config(user_config_file=None):
 def get_flags(path):
     global config
 
+    # like compressors, the most specific pattern setting a flag wins, and
+    # within a pattern the last action does
     flags = OrderedDict()
     for pattern, actions in config["filters"].items():
         if fnmatch(path, pattern):
+            pattern_flags = OrderedDict()
             for action in actions:
                 enable = not action.startswith("no-")
                 if not enable:
                     action = action[3:]
-                if action in ("cache", "discard", "skip"):
-                    flags[action] = enable
+                if action in (
+                    "cache",
+                    "discard",
+                    "meta",
+                    "template",
+                    "gzip-variant",
+                    "brotli-variant",
+                    "skip",
+                ):
+                    pattern_flags[action] = enable
+            for action, enable in pattern_flags.items():
+                flags.setdefault(action, enable)
 
     return flags
 
 
+# get_flags maps each flag to whether it is enabled, while load_state only
+# returns the enabled ones
+def enabled_flags(flags):
+    if isinstance(flags, dict):
+        return [flag for flag, enable in flags.items() if enable]
+    return list(flags)
+
+
 def get_compressor(path):
     global config
 
     for pattern, actions in config["filters"].items():
         if fnmatch(path, pattern):
             for action in actions:
-                if action in ("gzip", "heatshrink", "uncompressed"):
+                if action in ("auto", "gzip", "heatshrink", "lz4", "uncompressed"):
                     return action
     return "uncompressed"
 
@@ -146,7 +184,7 @@ def save_state(dst_dir, state):
                 path,
                 data["type"],
                 data["mtime"],
-                ",".join(data["flags"]),
+                ",".join(enabled_flags(data["flags"])),
                 data["compressor"],
             )
             writer.writerow(row)
@@ -155,9 +193,30 @@ def save_state(dst_dir, state):
     dotconfig["gzip"] = {
         "level": config["compressors"]["gzip"]["level"],
     }
+    dotconfig["brotli"] = {
+        "quality": config["compressors"].get("brotli", {}).get("quality", 11),
+    }
     dotconfig["heatshrink"] = {
         "window_sz2": config["compressors"]["heatshrink"]["window_sz2"],
         "lookahead_sz2": config["compressors"]["heatshrink"]["lookahead_sz2"],
+        "block_sz2": config["compressors"]["heatshrink"].get("block_sz2", 0),
+        "dict_len": config["compressors"]["heatshrink"].get("dict_len", 0),
+        "dict_max_file_len": config["compressors"]["heatshrink"].get(
+            "dict_max_file_len", 4096
+        ),
+    }
+    dotconfig["lz4"] = {
+        "block_sz2": config["compressors"].get("lz4", {}).get("block_sz2", 12),
+        "level": config["compressors"].get("lz4", {}).get("level", 9),
+    }
+    auto = config["compressors"].get("auto", {})
+    dotconfig["auto"] = {
+        "codecs": ",".join(auto.get("codecs", ["heatshrink", "lz4"])),
+        "max_ram": auto.get("max_ram", 0),
+        "max_decode_cost": auto.get("max_decode_cost", 0),
+    }
+    dotconfig["metadata"] = {
+        "cache_control": config["metadata"].get("cache_control", ""),
     }
     with open(os.path.join(dst_dir, ".config"), "w") as f:
         dotconfig.write(f)
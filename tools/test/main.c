@@ -10,7 +10,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "frogfs/espfs.h"
+#include "frogfs/frogfs.h"
 
 int main(int argc, char *argv[])
 {
@@ -28,6 +28,8 @@ int main(int argc, char *argv[])
     struct stat sb;
     if (fstat(fd, &sb) == -1) {
         fputs("fstat failed\n", stderr);
+        close(fd);
+        return EXIT_FAILURE;
     }
 
     void *mmap_addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
@@ -37,47 +39,47 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    espfs_config_t config = {
+    frogfs_config_t config = {
         .addr = mmap_addr,
     };
 
-    espfs_fs_t *fs = espfs_init(&config);
+    frogfs_fs_t *fs = frogfs_init(&config);
     if (fs == NULL) {
-        fputs("espfs_init failed\n", stderr);
+        fputs("frogfs_init failed\n", stderr);
         munmap(mmap_addr, sb.st_size);
         close(fd);
         return EXIT_FAILURE;
-
     }
 
-    espfs_stat_t stat;
-    if (espfs_stat(fs, argv[2], &stat)) {
-        if (stat.type == ESPFS_TYPE_FILE) {
+    frogfs_stat_t stat;
+    if (frogfs_stat(fs, argv[2], &stat)) {
+        if (stat.type == FROGFS_TYPE_FILE) {
             fprintf(stderr, "Object '%s' is a file.\n", argv[2]);
-            if (stat.compression == ESPFS_COMPRESSION_HEATSHRINK) {
-                fprintf(stderr, "File is compressed with heatsrhink.\n");
-            } else if (stat.compression != ESPFS_COMPRESSION_NONE) {
-                fprintf(stderr, "File is compressed wth unknown.\n");
+            if (stat.compression == FROGFS_COMPRESSION_HEATSHRINK) {
+                fprintf(stderr, "File is compressed with heatshrink.\n");
+            } else if (stat.compression == FROGFS_COMPRESSION_LZ4) {
+                fprintf(stderr, "File is compressed with lz4.\n");
+            } else if (stat.compression != FROGFS_COMPRESSION_NONE) {
+                fprintf(stderr, "File is compressed with unknown.\n");
             }
-            if (stat.flags & ESPFS_FLAG_GZIP) {
+            if (stat.flags & FROGFS_FLAG_GZIP) {
                 fprintf(stderr, "File is gzip encapsulated.\n");
             }
-            fprintf(stderr, "File is %d bytes.\n", stat.size);
-            espfs_file_t *f = espfs_fopen(fs, argv[2]);
+            fprintf(stderr, "File is %zu bytes.\n", stat.size);
+            frogfs_file_t *f = frogfs_fopen_obj(fs, stat.obj);
             if (f == NULL) {
                 fprintf(stderr, "Error opening file.\n");
             } else {
                 char buf[16];
-                int bytes;
+                ssize_t bytes;
                 fputs("File contents:\n", stderr);
-                while ((bytes = espfs_fread(f, buf, sizeof(buf))) ==
-                        sizeof(buf)) {
+                while ((bytes = frogfs_fread(f, buf, sizeof(buf))) > 0) {
                     fwrite(buf, bytes, 1, stdout);
                 }
                 fflush(stdout);
-                espfs_fclose(f);
+                frogfs_fclose(f);
             }
-        } else if (stat.type == ESPFS_TYPE_DIR) {
+        } else if (stat.type == FROGFS_TYPE_DIR) {
             fprintf(stderr, "Object '%s' is a directory.\n", argv[2]);
         } else {
             fprintf(stderr, "Object '%s' is an unknown type.\n", argv[2]);
@@ -86,7 +88,7 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Object '%s' does not exist.\n", argv[2]);
     }
 
-    espfs_deinit(fs);
+    frogfs_deinit(fs);
     munmap(mmap_addr, sb.st_size);
     close(fd);
     return EXIT_SUCCESS;
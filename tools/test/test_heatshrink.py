@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Round trip tests for the heatshrink encoder in mkfrogfs.py, which writes the
+# streams compressed against the image dictionary. They are decoded with the
+# heatshrink2 module; run with python3 -m unittest discover tools/test
+
+import os
+import random
+import sys
+import unittest
+
+import heatshrink2
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+from mkfrogfs import heatshrink_encode
+
+PARAMS = [(4, 3), (8, 4), (11, 4), (13, 6)]
+
+def samples():
+    rng = random.Random(1)
+    words = [b'frog', b'<div class="', b'function(', b'\n    ', b'0123456789']
+    yield b''
+    yield b'a'
+    yield b'\0' * 5000
+    yield bytes(rng.randrange(256) for _ in range(3000))
+    yield b''.join(rng.choice(words) for _ in range(2000))
+    # repeats just inside and outside of each window size
+    for sz2 in (4, 8, 11, 13):
+        block = bytes(rng.randrange(256) for _ in range((1 << sz2) - 1))
+        yield block + b'xyz' + block + b'xyz' + block
+
+def primed_stream(stream, prefix):
+    '''Prepend prefix to a stream as literals, which leaves an unprimed
+    decoder with prefix in its window, as heatshrink_prime does.'''
+    bits = ''.join('1{:08b}'.format(byte) for byte in prefix)
+    bits += ''.join('{:08b}'.format(byte) for byte in stream)
+    bits += '0' * (-len(bits) % 8)
+    return bytes(int(bits[i:i + 8], 2) for i in range(0, len(bits), 8))
+
+class HeatshrinkEncodeTest(unittest.TestCase):
+    def test_round_trip(self):
+        for window_sz2, lookahead_sz2 in PARAMS:
+            for data in samples():
+                stream = heatshrink_encode(data, window_sz2, lookahead_sz2,
+                        b'')
+                self.assertEqual(heatshrink2.decompress(stream,
+                        window_sz2=window_sz2, lookahead_sz2=lookahead_sz2),
+                        data, (window_sz2, lookahead_sz2, len(data)))
+
+    def test_primed_round_trip(self):
+        rng = random.Random(2)
+        for window_sz2, lookahead_sz2 in PARAMS:
+            window = 1 << window_sz2
+            dictionary = b''.join(rng.choice([b'frog', b'class="', b'\n  '])
+                    for _ in range(window))
+            for prefix in (dictionary[:3], dictionary[-window:]):
+                for data in samples():
+                    stream = heatshrink_encode(data, window_sz2,
+                            lookahead_sz2, prefix)
+                    # the padding of both streams can decode as a backref,
+                    # the runtime stops after file_len bytes anyway
+                    expected = prefix + data
+                    decoded = heatshrink2.decompress(
+                            primed_stream(stream, prefix),
+                            window_sz2=window_sz2,
+                            lookahead_sz2=lookahead_sz2)
+                    self.assertEqual(decoded[:len(expected)], expected,
+                            (window_sz2, lookahead_sz2, len(prefix),
+                            len(data)))
+
+    def test_primed_uses_prefix(self):
+        prefix = b'shared header text, '
+        data = prefix * 4
+        self.assertLess(len(heatshrink_encode(data, 8, 4, prefix)),
+                len(heatshrink_encode(data, 8, 4, b'')))
+
+if __name__ == '__main__':
+    unittest.main()